@@ -44,12 +44,18 @@ struct vifconfig {
     short               state;
     int                 ratelimit;
     int                 threshold;
+    short               fastleave;
+    unsigned int        maxGroups;
+    unsigned int        hostMaxGroups;
+    unsigned int        bandwidth;
 
     // Keep allowed nets for VIF.
     struct SubnetList*  allowednets;
 
     // Allowed Groups
     struct SubnetList*  allowedgroups;
+    struct GroupRange*  groupRanges;
+    unsigned int        groupRangeCount;
 
     // Next config in list...
     struct vifconfig*   next;
@@ -58,11 +64,37 @@ struct vifconfig {
 // Structure to keep vif configuration
 struct vifconfig *vifconf;
 
+// Groups pinned by staticgroup stanzas
+static struct StaticGroup *staticGroups;
+
+// Group ranges mapped to sources by ssmmap stanzas
+struct SsmMapping {
+    struct SsmMapping   *next;
+    uint32_t            subnet_addr;
+    uint32_t            subnet_mask;
+    int                 nsources;
+    uint32_t            sources[MAX_ORIGINS];
+};
+static struct SsmMapping *ssmMappings;
+
+// Group ranges given a bitrate by bitrate stanzas
+struct GroupBitrate {
+    struct GroupBitrate *next;
+    uint32_t            subnet_addr;
+    uint32_t            subnet_mask;
+    unsigned int        bitrate;        // kbit/s
+    int                 priority;
+};
+static struct GroupBitrate *groupBitrates;
+
 // Keeps common settings...
 static struct Config commonConfig;
 
 // Prototypes...
 struct vifconfig *parsePhyintToken(void);
+struct StaticGroup *parseStaticGroupToken(void);
+struct SsmMapping *parseSsmMapToken(void);
+struct GroupBitrate *parseBitrateToken(void);
 struct SubnetList *parseSubnetAddress(char *addrstr);
 
 /**
@@ -87,6 +119,75 @@ static void initCommonConfig(void) {
     // aimwang: default value
     commonConfig.defaultInterfaceState = IF_STATE_DISABLED;
     commonConfig.rescanVif = 0;
+
+    // If 1, the proxy sends its own membership reports upstream.
+    commonConfig.upstreamReports = 0;
+
+    // Max IGMP packets per second sent on each interface.
+    commonConfig.igmpPacing = DEFAULT_IGMP_PACING;
+
+    // Query timers are fixed by default.
+    commonConfig.adaptiveLatency = 0;
+
+    // Groups are left upstream as soon as they have no listeners.
+    commonConfig.holdDown = 0;
+
+    // No groups are pre-joined by default.
+    commonConfig.prejoinCount = 0;
+    commonConfig.prejoinBudget = 0;
+    commonConfig.prejoinFile = NULL;
+
+    // Each group is joined on a single upstream.
+    commonConfig.joinAllUpstreams = 0;
+
+    // Upstreams are only given up when their link goes down.
+    commonConfig.upstreamTimeout = 0;
+
+    // Reports of hosts are not rate limited by default.
+    commonConfig.reportLimitRate = 0;
+    commonConfig.reportLimitBurst = 0;
+}
+
+/**
+*   Returns the groups pinned by staticgroup stanzas...
+*/
+struct StaticGroup *getStaticGroups(void) {
+    return staticGroups;
+}
+
+/**
+*   Looks up the SSM mapping of a group. Copies the mapped sources
+*   into 'sources', which must hold MAX_ORIGINS addresses, and
+*   returns their number. Returns 0 for groups that are not mapped.
+*/
+int getSsmSources(uint32_t group, uint32_t *sources) {
+    struct SsmMapping *sm;
+
+    for(sm = ssmMappings; sm != NULL; sm = sm->next) {
+        if((group & sm->subnet_mask) == sm->subnet_addr) {
+            memcpy(sources, sm->sources, sm->nsources * sizeof(uint32_t));
+            return sm->nsources;
+        }
+    }
+    return 0;
+}
+
+/**
+*   Looks up the bitrate of a group, in kbit/s, and its admission
+*   priority. Groups without a bitrate stanza have a bitrate and
+*   priority of 0.
+*/
+unsigned int getGroupBitrate(uint32_t group, int *priority) {
+    struct GroupBitrate *gb;
+
+    for(gb = groupBitrates; gb != NULL; gb = gb->next) {
+        if((group & gb->subnet_mask) == gb->subnet_addr) {
+            *priority = gb->priority;
+            return gb->bitrate;
+        }
+    }
+    *priority = 0;
+    return 0;
 }
 
 /**
@@ -103,6 +204,13 @@ struct Config *getCommonConfig(void) {
 int loadConfig(char *configFile) {
     struct vifconfig  *tmpPtr;
     struct vifconfig  **currPtr = &vifconf;
+    struct StaticGroup *sgPtr;
+    struct StaticGroup **sgCurrPtr = &staticGroups;
+    struct SsmMapping *smPtr;
+    struct SsmMapping **smCurrPtr = &ssmMappings;
+    struct GroupBitrate *gbPtr;
+    struct GroupBitrate **gbCurrPtr = &groupBitrates;
+    unsigned int minLatency;
     char *token;
 
     // Initialize common config
@@ -145,6 +253,51 @@ int loadConfig(char *configFile) {
                 currPtr = &tmpPtr->next;
             }
         }
+        else if(strcmp("staticgroup", token)==0) {
+            // Got a staticgroup token... Call static group parser
+            my_log(LOG_DEBUG, 0, "Config: Got a staticgroup token.");
+            sgPtr = parseStaticGroupToken();
+            if(sgPtr == NULL) {
+                // Unparsable token... Exit...
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Invalid staticgroup stanza in configfile");
+                return 0;
+            }
+
+            // Insert config, and move temppointer to next location...
+            *sgCurrPtr = sgPtr;
+            sgCurrPtr = &sgPtr->next;
+        }
+        else if(strcmp("ssmmap", token)==0) {
+            // Got a ssmmap token... Call SSM mapping parser
+            my_log(LOG_DEBUG, 0, "Config: Got a ssmmap token.");
+            smPtr = parseSsmMapToken();
+            if(smPtr == NULL) {
+                // Unparsable token... Exit...
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Invalid ssmmap stanza in configfile");
+                return 0;
+            }
+
+            // Insert config, and move temppointer to next location...
+            *smCurrPtr = smPtr;
+            smCurrPtr = &smPtr->next;
+        }
+        else if(strcmp("bitrate", token)==0) {
+            // Got a bitrate token... Call bitrate parser
+            my_log(LOG_DEBUG, 0, "Config: Got a bitrate token.");
+            gbPtr = parseBitrateToken();
+            if(gbPtr == NULL) {
+                // Unparsable token... Exit...
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Invalid bitrate stanza in configfile");
+                return 0;
+            }
+
+            // Insert config, and move temppointer to next location...
+            *gbCurrPtr = gbPtr;
+            gbCurrPtr = &gbPtr->next;
+        }
         else if(strcmp("quickleave", token)==0) {
             // Got a quickleave token....
             my_log(LOG_DEBUG, 0, "Config: Quick leave mode enabled.");
@@ -154,6 +307,15 @@ int loadConfig(char *configFile) {
             token = nextConfigToken();
             continue;
         }
+        else if(strcmp("joinallupstreams", token)==0) {
+            // Got a joinallupstreams token...
+            my_log(LOG_DEBUG, 0, "Config: Joining groups on all upstream interfaces.");
+            commonConfig.joinAllUpstreams = 1;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
         else if(strcmp("defaultdown", token)==0) {
             // Got a defaultdown token...
             my_log(LOG_DEBUG, 0, "Config: interface Default as down stream.");
@@ -171,6 +333,150 @@ int loadConfig(char *configFile) {
             // Read next token...
             token = nextConfigToken();
             continue;
+        }
+        else if(strcmp("upstreamreports", token)==0) {
+            // Got a upstreamreports token...
+            my_log(LOG_DEBUG, 0, "Config: Sending own IGMPv3 reports upstream.");
+            commonConfig.upstreamReports = 1;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("igmppacing", token)==0) {
+            // Got a igmppacing token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Config: igmppacing needs a packet rate.");
+                return 0;
+            }
+            commonConfig.igmpPacing = atoi(token);
+            my_log(LOG_DEBUG, 0, "Config: Sending at most %d IGMP packets per second on an interface.",
+                commonConfig.igmpPacing);
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("adaptivequery", token)==0) {
+            // Got a adaptivequery token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) <= 0) {
+                my_log(LOG_WARNING, 0, "Config: adaptivequery needs a leave detection time.");
+                return 0;
+            }
+            commonConfig.adaptiveLatency = atoi(token);
+
+            // The query interval must exceed the response interval, so a
+            // group membership interval cannot be shorter than this.
+            minLatency = commonConfig.queryResponseInterval +
+                commonConfig.robustnessValue * (commonConfig.queryResponseInterval + 1);
+            if(commonConfig.adaptiveLatency < minLatency) {
+                my_log(LOG_WARNING, 0, "Config: adaptivequery %d is below the shortest leave detection time. Using %u.",
+                    commonConfig.adaptiveLatency, minLatency);
+                commonConfig.adaptiveLatency = minLatency;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Adapting query timers, leave detection within %d seconds.",
+                commonConfig.adaptiveLatency);
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("holddown", token)==0) {
+            // Got a holddown token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Config: holddown needs a time in seconds.");
+                return 0;
+            }
+            commonConfig.holdDown = atoi(token);
+            my_log(LOG_DEBUG, 0, "Config: Holding groups upstream for %d seconds.",
+                commonConfig.holdDown);
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("upstreamtimeout", token)==0) {
+            // Got a upstreamtimeout token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Config: upstreamtimeout needs a time in seconds.");
+                return 0;
+            }
+            commonConfig.upstreamTimeout = atoi(token);
+            my_log(LOG_DEBUG, 0, "Config: Giving up upstreams without queries for %d seconds.",
+                commonConfig.upstreamTimeout);
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("reportlimit", token)==0) {
+            // Got a reportlimit token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) <= 0) {
+                my_log(LOG_WARNING, 0, "Config: reportlimit needs a rate in reports per second.");
+                return 0;
+            }
+            commonConfig.reportLimitRate = atoi(token);
+            commonConfig.reportLimitBurst = 2 * commonConfig.reportLimitRate;
+
+            // Read the optional burst...
+            token = nextConfigToken();
+            if(token != NULL && strcmp("burst", token)==0) {
+                token = nextConfigToken();
+                if(token == NULL || atoi(token) <= 0) {
+                    my_log(LOG_WARNING, 0, "Config: reportlimit burst needs a number of reports.");
+                    return 0;
+                }
+                commonConfig.reportLimitBurst = atoi(token);
+                token = nextConfigToken();
+            }
+            my_log(LOG_DEBUG, 0, "Config: Limiting each host to %d reports per second, burst %d.",
+                commonConfig.reportLimitRate, commonConfig.reportLimitBurst);
+            continue;
+        }
+        else if(strcmp("prejoin", token)==0) {
+            // Got a prejoin token...
+            token = nextConfigToken();
+            if(token == NULL || atoi(token) <= 0) {
+                my_log(LOG_WARNING, 0, "Config: prejoin needs a number of groups.");
+                return 0;
+            }
+            commonConfig.prejoinCount = atoi(token);
+            my_log(LOG_DEBUG, 0, "Config: Pre-joining the %d most popular groups.",
+                commonConfig.prejoinCount);
+
+            // Read the optional budget and file...
+            token = nextConfigToken();
+            while(token != NULL) {
+                if(strcmp("budget", token)==0) {
+                    token = nextConfigToken();
+                    if(token == NULL || atoi(token) < 0) {
+                        my_log(LOG_WARNING, 0, "Config: prejoin budget needs a rate in kbit/s.");
+                        return 0;
+                    }
+                    commonConfig.prejoinBudget = atoi(token);
+                    my_log(LOG_DEBUG, 0, "Config: Pre-join budget %d kbit/s.", commonConfig.prejoinBudget);
+                }
+                else if(strcmp("file", token)==0) {
+                    token = nextConfigToken();
+                    if(token == NULL) {
+                        my_log(LOG_WARNING, 0, "Config: prejoin file needs a path.");
+                        return 0;
+                    }
+                    free(commonConfig.prejoinFile);
+                    commonConfig.prejoinFile = strdup(token);
+                    my_log(LOG_DEBUG, 0, "Config: Saving group popularity in %s.", commonConfig.prejoinFile);
+                }
+                else {
+                    break;
+                }
+                token = nextConfigToken();
+            }
+            continue;
         } else {
             // Unparsable token... Exit...
             closeConfigFile();
@@ -219,6 +525,10 @@ void configureVifs(void) {
 
                     Dp->threshold = confPtr->threshold;
                     Dp->ratelimit = confPtr->ratelimit;
+                    Dp->fastleave = confPtr->fastleave;
+                    Dp->maxGroups = confPtr->maxGroups;
+                    Dp->hostMaxGroups = confPtr->hostMaxGroups;
+                    Dp->bandwidth = confPtr->bandwidth;
 
                     // Go to last allowed net on VIF...
                     for(vifLast = Dp->allowednets; vifLast->next; vifLast = vifLast->next);
@@ -227,15 +537,78 @@ void configureVifs(void) {
                     vifLast->next = confPtr->allowednets;
 
                     Dp->allowedgroups = confPtr->allowedgroups;
+                    Dp->groupRanges = confPtr->groupRanges;
+                    Dp->groupRangeCount = confPtr->groupRangeCount;
 
                     break;
                 }
             }
         }
     }
+
+    // The altnets are in the address lookups now.
+    invalidateIfAddresses();
 }
 
 
+/**
+*   Orders group ranges by their first group.
+*/
+static int compareGroupRanges(const void *a, const void *b) {
+    const struct GroupRange *ra = a, *rb = b;
+
+    return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+/**
+*   Compiles a whitelist into sorted, disjoint group ranges, so a
+*   group is checked with a binary search. Entries with host bits
+*   set never matched a group, and are left out.
+*/
+static struct GroupRange *compileGroupRanges(struct SubnetList *list, unsigned int *count) {
+    struct GroupRange   *ranges;
+    struct SubnetList   *sn;
+    unsigned int        n = 0, i, merged;
+
+    for(sn = list; sn != NULL; sn = sn->next) {
+        n++;
+    }
+    *count = 0;
+    if(n == 0) {
+        return NULL;
+    }
+
+    ranges = (struct GroupRange*) malloc(n * sizeof(struct GroupRange));
+    if(ranges == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    for(n = 0, sn = list; sn != NULL; sn = sn->next) {
+        if((sn->subnet_addr & ~sn->subnet_mask) != 0) {
+            continue;
+        }
+        ranges[n].first = ntohl(sn->subnet_addr);
+        ranges[n].last  = ntohl(sn->subnet_addr | ~sn->subnet_mask);
+        n++;
+    }
+    qsort(ranges, n, sizeof(struct GroupRange), compareGroupRanges);
+
+    // Merge overlapping and adjacent ranges...
+    for(merged = 0, i = 0; i < n; i++) {
+        if(merged > 0 && (ranges[merged - 1].last == 0xFFFFFFFF ||
+                          ranges[i].first <= ranges[merged - 1].last + 1)) {
+            if(ranges[i].last > ranges[merged - 1].last) {
+                ranges[merged - 1].last = ranges[i].last;
+            }
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+
+    my_log(LOG_DEBUG, 0, "Config: IF: Compiled %u whitelist entries into %u ranges.", n, merged);
+    *count = merged;
+    return ranges;
+}
+
 /**
 *   Internal function to parse phyint config
 */
@@ -263,9 +636,15 @@ struct vifconfig *parsePhyintToken(void) {
     tmpPtr->next = NULL;    // Important to avoid seg fault...
     tmpPtr->ratelimit = 0;
     tmpPtr->threshold = 1;
+    tmpPtr->fastleave = 1;
+    tmpPtr->maxGroups = 0;
+    tmpPtr->hostMaxGroups = 0;
+    tmpPtr->bandwidth = 0;
     tmpPtr->state = commonConfig.defaultInterfaceState;
     tmpPtr->allowednets = NULL;
     tmpPtr->allowedgroups = NULL;
+    tmpPtr->groupRanges = NULL;
+    tmpPtr->groupRangeCount = 0;
 
     // Make a copy of the token to store the IF name
     tmpPtr->name = strdup( token );
@@ -323,6 +702,49 @@ struct vifconfig *parsePhyintToken(void) {
             my_log(LOG_DEBUG, 0, "Config: IF: Got disabled token.");
             tmpPtr->state = IF_STATE_DISABLED;
         }
+        else if(strcmp("fastleave", token)==0) {
+            // Fast leave
+            my_log(LOG_DEBUG, 0, "Config: IF: Got fastleave token.");
+            tmpPtr->fastleave = 1;
+        }
+        else if(strcmp("reportsuppression", token)==0) {
+            // Hosts suppress their reports, so the last one leaving says nothing
+            my_log(LOG_DEBUG, 0, "Config: IF: Got reportsuppression token.");
+            tmpPtr->fastleave = 0;
+        }
+        else if(strcmp("maxgroups", token)==0) {
+            // Group cap of the interface
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: IF: Got maxgroups token '%s'.", token);
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Maxgroups must be 0 or more.");
+                parseError = 1;
+                break;
+            }
+            tmpPtr->maxGroups = atoi( token );
+        }
+        else if(strcmp("hostmaxgroups", token)==0) {
+            // Group cap of each host
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: IF: Got hostmaxgroups token '%s'.", token);
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Hostmaxgroups must be 0 or more.");
+                parseError = 1;
+                break;
+            }
+            tmpPtr->hostMaxGroups = atoi( token );
+        }
+        else if(strcmp("bandwidth", token)==0) {
+            // Bandwidth budget
+            token = nextConfigToken();
+            my_log(LOG_DEBUG, 0, "Config: IF: Got bandwidth token '%s'.", token);
+            if(token == NULL || atoi(token) < 0) {
+                my_log(LOG_WARNING, 0, "Bandwidth must be 0 or more.");
+                parseError = 1;
+                break;
+            }
+            tmpPtr->bandwidth = atoi( token );
+        }
         else if(strcmp("ratelimit", token)==0) {
             // Ratelimit
             token = nextConfigToken();
@@ -357,11 +779,219 @@ struct vifconfig *parsePhyintToken(void) {
         free(tmpPtr->name);
         free(tmpPtr);
         tmpPtr = NULL;
+    } else {
+        tmpPtr->groupRanges = compileGroupRanges(tmpPtr->allowedgroups, &tmpPtr->groupRangeCount);
+    }
+
+    return tmpPtr;
+}
+
+/**
+*   Parses a staticgroup stanza:
+*   staticgroup <group> [source <addr>]... interface <ifname> [interface <ifname>]...
+*/
+struct StaticGroup *parseStaticGroupToken(void) {
+    struct StaticGroup  *tmpPtr;
+    char                *token;
+    uint32_t            addr;
+    short               parseError = 0;
+
+    // First token should be the group...
+    token = nextConfigToken();
+    if(token == NULL) return NULL;
+    addr = inet_addr(token);
+    if(!IN_MULTICAST(ntohl(addr))) {
+        my_log(LOG_WARNING, 0, "Config: staticgroup: %s is not a multicast group.", token);
+        return NULL;
+    }
+
+    tmpPtr = (struct StaticGroup*)malloc(sizeof(struct StaticGroup));
+    if(tmpPtr == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    memset(tmpPtr, 0, sizeof(struct StaticGroup));
+    tmpPtr->group = addr;
+
+    // Parse the sources and interfaces...
+    token = nextConfigToken();
+    while(token != NULL) {
+        if(strcmp("source", token)==0) {
+            token = nextConfigToken();
+            addr = token != NULL ? inet_addr(token) : INADDR_NONE;
+            if(addr == INADDR_NONE || addr == INADDR_ANY || IN_MULTICAST(ntohl(addr))) {
+                my_log(LOG_WARNING, 0, "Config: staticgroup: Invalid source address.");
+                parseError = 1;
+                break;
+            }
+            if(tmpPtr->nsources == MAX_ORIGINS) {
+                my_log(LOG_WARNING, 0, "Config: staticgroup: At most %d sources per group.", MAX_ORIGINS);
+                parseError = 1;
+                break;
+            }
+            tmpPtr->sources[tmpPtr->nsources++] = addr;
+        }
+        else if(strcmp("interface", token)==0) {
+            token = nextConfigToken();
+            if(token == NULL || strlen(token) >= IF_NAMESIZE || tmpPtr->nifs == MAX_IF) {
+                my_log(LOG_WARNING, 0, "Config: staticgroup: Invalid interface.");
+                parseError = 1;
+                break;
+            }
+            tmpPtr->ifnames[tmpPtr->nifs] = strdup(token);
+            if(tmpPtr->ifnames[tmpPtr->nifs] == NULL) {
+                my_log(LOG_ERR, 0, "Out of memory.");
+            }
+            tmpPtr->nifs++;
+        }
+        else {
+            // Unknown token. Break...
+            break;
+        }
+        token = nextConfigToken();
+    }
+
+    if(!parseError && tmpPtr->nifs == 0) {
+        my_log(LOG_WARNING, 0, "Config: staticgroup: No interface given.");
+        parseError = 1;
+    }
+
+    // Clean up after a parseerror...
+    if(parseError) {
+        while(tmpPtr->nifs > 0) {
+            free(tmpPtr->ifnames[--tmpPtr->nifs]);
+        }
+        free(tmpPtr);
+        tmpPtr = NULL;
+    } else {
+        my_log(LOG_DEBUG, 0, "Config: Static group %s on %d interfaces with %d sources.",
+            inetFmt(tmpPtr->group, s1), tmpPtr->nifs, tmpPtr->nsources);
+    }
+
+    return tmpPtr;
+}
+
+/**
+*   Parses a ssmmap stanza:
+*   ssmmap <group prefix> source <addr> [source <addr>]...
+*/
+struct SsmMapping *parseSsmMapToken(void) {
+    struct SsmMapping   *tmpPtr;
+    struct SubnetList   *range;
+    char                *token;
+    uint32_t            addr;
+    short               parseError = 0;
+
+    // First token should be the group range...
+    token = nextConfigToken();
+    if(token == NULL) return NULL;
+    range = parseSubnetAddress(token);
+    if(range == NULL || !IN_MULTICAST(ntohl(range->subnet_addr))) {
+        my_log(LOG_WARNING, 0, "Config: ssmmap: Invalid group range.");
+        free(range);
+        return NULL;
+    }
+
+    tmpPtr = (struct SsmMapping*)malloc(sizeof(struct SsmMapping));
+    if(tmpPtr == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    memset(tmpPtr, 0, sizeof(struct SsmMapping));
+    tmpPtr->subnet_addr = range->subnet_addr;
+    tmpPtr->subnet_mask = range->subnet_mask;
+    free(range);
+
+    // Parse the sources...
+    token = nextConfigToken();
+    while(token != NULL && strcmp("source", token)==0) {
+        token = nextConfigToken();
+        addr = token != NULL ? inet_addr(token) : INADDR_NONE;
+        if(addr == INADDR_NONE || addr == INADDR_ANY || IN_MULTICAST(ntohl(addr))) {
+            my_log(LOG_WARNING, 0, "Config: ssmmap: Invalid source address.");
+            parseError = 1;
+            break;
+        }
+        if(tmpPtr->nsources == MAX_ORIGINS) {
+            my_log(LOG_WARNING, 0, "Config: ssmmap: At most %d sources per range.", MAX_ORIGINS);
+            parseError = 1;
+            break;
+        }
+        tmpPtr->sources[tmpPtr->nsources++] = addr;
+        token = nextConfigToken();
+    }
+
+    if(!parseError && tmpPtr->nsources == 0) {
+        my_log(LOG_WARNING, 0, "Config: ssmmap: No source given.");
+        parseError = 1;
+    }
+
+    // Clean up after a parseerror...
+    if(parseError) {
+        free(tmpPtr);
+        tmpPtr = NULL;
+    } else {
+        my_log(LOG_DEBUG, 0, "Config: SSM mapping for %s with %d sources.",
+            inetFmts(tmpPtr->subnet_addr, tmpPtr->subnet_mask, s1), tmpPtr->nsources);
     }
 
     return tmpPtr;
 }
 
+/**
+*   Parses a bitrate stanza:
+*   bitrate <group prefix> <kbit/s> [priority <n>]
+*/
+struct GroupBitrate *parseBitrateToken(void) {
+    struct GroupBitrate *tmpPtr;
+    struct SubnetList   *range;
+    char                *token;
+
+    // First token should be the group range...
+    token = nextConfigToken();
+    if(token == NULL) return NULL;
+    range = parseSubnetAddress(token);
+    if(range == NULL || !IN_MULTICAST(ntohl(range->subnet_addr))) {
+        my_log(LOG_WARNING, 0, "Config: bitrate: Invalid group range.");
+        free(range);
+        return NULL;
+    }
+
+    tmpPtr = (struct GroupBitrate*)malloc(sizeof(struct GroupBitrate));
+    if(tmpPtr == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    memset(tmpPtr, 0, sizeof(struct GroupBitrate));
+    tmpPtr->subnet_addr = range->subnet_addr;
+    tmpPtr->subnet_mask = range->subnet_mask;
+    free(range);
+
+    // ...then the bitrate...
+    token = nextConfigToken();
+    if(token == NULL || atoi(token) <= 0) {
+        my_log(LOG_WARNING, 0, "Config: bitrate: Bitrate must be more than 0.");
+        free(tmpPtr);
+        return NULL;
+    }
+    tmpPtr->bitrate = atoi(token);
+
+    // ...and an optional priority.
+    token = nextConfigToken();
+    if(token != NULL && strcmp("priority", token)==0) {
+        token = nextConfigToken();
+        if(token == NULL) {
+            my_log(LOG_WARNING, 0, "Config: bitrate: Missing priority.");
+            free(tmpPtr);
+            return NULL;
+        }
+        tmpPtr->priority = atoi(token);
+        token = nextConfigToken();
+    }
+
+    my_log(LOG_DEBUG, 0, "Config: Bitrate of %s is %u kbit/s, priority %d.",
+        inetFmts(tmpPtr->subnet_addr, tmpPtr->subnet_mask, s1), tmpPtr->bitrate, tmpPtr->priority);
+
+    return tmpPtr;
+}
+
 /**
 *   Parses a subnet address string on the format
 *   a.b.c.d/n into a SubnetList entry.
@@ -43,6 +43,14 @@ static inline uint32_t s_addr_from_sockaddr(const struct sockaddr *addr) {
 
 struct IfDesc IfDescVc[ MAX_IF ], *IfDescEp = IfDescVc;
 
+// Prefix trie of the allowed nets of all interfaces, for getIfByAddress().
+static struct LpmNode *addressTrie;
+static int addressTrieStale = 1;
+
+// Open addressed hash of the interfaces by kernel index, for getIfByIfIndex().
+#define IFINDEX_MAP_SIZE    64      // Power of two above MAX_IF
+static struct IfDesc *ifIndexMap[ IFINDEX_MAP_SIZE ];
+
 /* aimwang: add for detect interface and rebuild IfVc record */
 /***************************************************
  * TODO:    Only need run me when detect downstream changed.
@@ -126,6 +134,7 @@ void rebuildIfVc () {
         if ( ioctl( Sock, SIOCGIFFLAGS, &IfReq ) < 0 )
             my_log( LOG_ERR, errno, "ioctl SIOCGIFFLAGS" );
         Dp->Flags = IfReq.ifr_flags;
+        Dp->ifIndex = if_nametoindex(Dp->Name);
 
         if (0x10d1 == Dp->Flags)
         {
@@ -146,6 +155,7 @@ void rebuildIfVc () {
             Dp->robustness    = DEFAULT_ROBUSTNESS;
             Dp->threshold     = DEFAULT_THRESHOLD;   /* ttl limit */
             Dp->ratelimit     = DEFAULT_RATELIMIT;
+            Dp->fastleave     = 1;
         }
 
         // Set the network address for the IF..
@@ -193,6 +203,8 @@ void rebuildIfVc () {
     }
 
     close( Sock );
+    invalidateIfAddresses();
+    updateIgmpFilter();
 }
 
 /*
@@ -287,6 +299,7 @@ void buildIfVc(void) {
                 my_log( LOG_ERR, errno, "ioctl SIOCGIFFLAGS" );
 
             IfDescEp->Flags = IfReq.ifr_flags;
+            IfDescEp->ifIndex = if_nametoindex(IfDescEp->Name);
 
             // aimwang: when pppx get dstaddr for use
             if (0x10d1 == IfDescEp->Flags)
@@ -311,6 +324,7 @@ void buildIfVc(void) {
             IfDescEp->robustness    = DEFAULT_ROBUSTNESS;
             IfDescEp->threshold     = DEFAULT_THRESHOLD;   /* ttl limit */
             IfDescEp->ratelimit     = DEFAULT_RATELIMIT;
+            IfDescEp->fastleave     = 1;
 
             // Debug log the result...
             my_log( LOG_DEBUG, 0, "buildIfVc: Interface %s Addr: %s, Flags: 0x%04x, Network: %s",
@@ -324,6 +338,7 @@ void buildIfVc(void) {
     }
 
     close( Sock );
+    invalidateIfAddresses();
 }
 
 /*
@@ -356,39 +371,131 @@ struct IfDesc *getIfByIx( unsigned Ix ) {
 }
 
 /**
-*   Returns a pointer to the IfDesc whose subnet matches
-*   the supplied IP adress. The IP must match a interfaces
-*   subnet, or any configured allowed subnet on a interface.
+*   Returns the prefix length of a contiguous subnet mask.
 */
-struct IfDesc *getIfByAddress( uint32_t ipaddr ) {
+static int maskLength( uint32_t mask ) {
+    uint32_t m = ntohl(mask);
+    int len = 0;
+
+    while (m & 0x80000000) {
+        m <<= 1;
+        len++;
+    }
+    return len;
+}
+
+/**
+*   Marks the address tries and the kernel index map stale, after the
+*   interfaces or their allowed nets have changed. They are rebuilt
+*   on the next lookup.
+*/
+void invalidateIfAddresses( void ) {
+    addressTrieStale = 1;
+}
 
+/**
+*   Rebuilds the address trie, and the allowed net trie of each
+*   interface, from the allowed nets. The kernel index map is
+*   rebuilt along.
+*/
+static void buildAddressTries( void ) {
     struct IfDesc       *Dp;
     struct SubnetList   *currsubnet;
-    struct IfDesc       *res = NULL;
-    uint32_t            last_subnet_mask = 0;
+    unsigned            slot;
+
+    lpmFree(&addressTrie);
+    memset(ifIndexMap, 0, sizeof(ifIndexMap));
+    for ( Dp = IfDescEp; Dp-- > IfDescVc; ) {
+        if (Dp->ifIndex != 0) {
+            for (slot = Dp->ifIndex; ifIndexMap[slot % IFINDEX_MAP_SIZE] != NULL; slot++);
+            ifIndexMap[slot % IFINDEX_MAP_SIZE] = Dp;
+        }
 
-    for ( Dp = IfDescVc; Dp < IfDescEp; Dp++ ) {
-        // Loop through all registered allowed nets of the VIF...
+        lpmFree(&Dp->netTrie);
         for(currsubnet = Dp->allowednets; currsubnet != NULL; currsubnet = currsubnet->next) {
-            // Check if the ip falls in under the subnet....
-            if(currsubnet->subnet_mask > last_subnet_mask && (ipaddr & currsubnet->subnet_mask) == currsubnet->subnet_addr) {
-                res = Dp;
-                last_subnet_mask = currsubnet->subnet_mask;
+            lpmInsert(&Dp->netTrie, currsubnet->subnet_addr & currsubnet->subnet_mask,
+                      maskLength(currsubnet->subnet_mask), 1);
+
+            // Default routes and nets with host bits set never match an address. The
+            // interfaces are walked backwards, so the first one wins equal prefixes.
+            if(currsubnet->subnet_mask != 0 &&
+               (currsubnet->subnet_addr & ~currsubnet->subnet_mask) == 0) {
+                lpmInsert(&addressTrie, currsubnet->subnet_addr,
+                          maskLength(currsubnet->subnet_mask), Dp - IfDescVc);
             }
         }
     }
-    return res;
+    addressTrieStale = 0;
 }
 
-
 /**
 *   Returns a pointer to the IfDesc whose subnet matches
 *   the supplied IP adress. The IP must match a interfaces
 *   subnet, or any configured allowed subnet on a interface.
 */
+struct IfDesc *getIfByAddress( uint32_t ipaddr ) {
+    int Ix;
+
+    if (addressTrieStale) {
+        buildAddressTries();
+    }
+    if (!lpmLookup(addressTrie, ipaddr, &Ix)) {
+        return NULL;
+    }
+    return &IfDescVc[ Ix ];
+}
+
+
+/**
+*   Returns a pointer to the IfDesc with the supplied kernel
+*   interface index, or NULL if there is none. Secondary addresses
+*   and alias labels share the index of their interface. Of those,
+*   the one whose subnet holds 'src' is taken, else the only one that
+*   is not disabled. If neither settles it, NULL is returned, and the
+*   caller is left with the subnet lookup.
+*/
+struct IfDesc *getIfByIfIndex( unsigned ifindex, uint32_t src ) {
+    struct IfDesc       *Dp, *first = NULL, *subnet = NULL, *enabled = NULL;
+    unsigned            slot, count = 0, enabledCount = 0;
+    int                 value;
+
+    if (addressTrieStale) {
+        buildAddressTries();
+    }
+    for (slot = ifindex; (Dp = ifIndexMap[slot % IFINDEX_MAP_SIZE]) != NULL; slot++) {
+        if (Dp->ifIndex != ifindex) {
+            continue;
+        }
+        if (first == NULL) {
+            first = Dp;
+        }
+        count++;
+        if (lpmLookup(Dp->netTrie, src, &value) &&
+            (subnet == NULL || subnet->state == IF_STATE_DISABLED)) {
+            subnet = Dp;
+        }
+        if (Dp->state != IF_STATE_DISABLED) {
+            enabled = Dp;
+            enabledCount++;
+        }
+    }
+
+    if (count <= 1) {
+        return first;
+    }
+    if (subnet != NULL) {
+        return subnet;
+    }
+    return enabledCount == 1 ? enabled : NULL;
+}
+
+/**
+*   Returns a pointer to the IfDesc that has been assigned
+*   the supplied VIF index, or NULL if there is none.
+*/
 struct IfDesc *getIfByVifIndex( unsigned vifindex ) {
     struct IfDesc       *Dp;
-    if(vifindex>0) {
+    if(vifindex != (unsigned)-1) {
         for ( Dp = IfDescVc; Dp < IfDescEp; Dp++ ) {
             if(Dp->index == vifindex) {
                 return Dp;
@@ -399,23 +506,44 @@ struct IfDesc *getIfByVifIndex( unsigned vifindex ) {
 }
 
 
+/**
+*   Function that checks if a group may be forwarded on the
+*   supplied VIF, by a binary search of its compiled whitelist.
+*   All groups are allowed when it has no whitelist.
+*/
+int isGroupAllowedForIf( struct IfDesc* intrface, uint32_t group ) {
+    uint32_t g = ntohl(group);
+    unsigned lo = 0, hi = intrface->groupRangeCount, mid;
+
+    if (intrface->allowedgroups == NULL) {
+        return 1;
+    }
+
+    // Find the last range starting at or below the group...
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (intrface->groupRanges[mid].first <= g) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 && g <= intrface->groupRanges[lo - 1].last;
+}
+
 /**
 *   Function that checks if a given ipaddress is a valid
 *   address for the supplied VIF.
 */
 int isAdressValidForIf( struct IfDesc* intrface, uint32_t ipaddr ) {
-    struct SubnetList   *currsubnet;
+    int value;
 
     if(intrface == NULL) {
         return 0;
     }
 
-    // Loop through all registered allowed nets of the VIF...
-    for(currsubnet = intrface->allowednets; currsubnet != NULL; currsubnet = currsubnet->next) {
-        // Check if the ip falls in under the subnet....
-        if((ipaddr & currsubnet->subnet_mask) == (currsubnet->subnet_addr& currsubnet->subnet_mask)) {
-            return 1;
-        }
+    if (addressTrieStale) {
+        buildAddressTries();
     }
-    return 0;
+    return lpmLookup(intrface->netTrie, ipaddr, &value);
 }
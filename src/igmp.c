@@ -39,6 +39,10 @@
 #include "igmpproxy.h"
 #include "igmpv3.h"
 
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+
 // Globals
 uint32_t     allhosts_group;            /* All hosts addr in net order */
 uint32_t     allrouters_group;          /* All hosts addr in net order */
@@ -46,6 +50,37 @@ uint32_t     alligmp3_group;            /* IGMPv3 addr in net order */
 
 extern int MRouterFD;
 
+/*
+ * Outbound IGMP is paced per sending interface. Packets over the
+ * per second budget of an interface wait in a queue, which is
+ * drained once a second.
+ */
+#define MAX_PACED_PACKETS 4096
+
+struct PacedPacket {
+    struct PacedPacket *next;
+    uint32_t    src, dst;
+    int         type, code, len;
+    char        buf[];
+};
+
+struct PaceState {
+    uint32_t    src;
+    time_t      second;
+    unsigned    sent;
+};
+
+static struct PacedPacket *pacedHead, **pacedTail = &pacedHead;
+static int pacedCount;
+static int drainScheduled;
+static struct PaceState paceStates[MAX_IF];
+
+/*
+ * The addresses of the own interfaces, as last put in the socket filter.
+ */
+static uint32_t filterAddrs[MAX_IF];
+static int filterAddrCount = -1;
+
 /*
  * Open and initialize the igmp socket, and fill in the non-changing
  * IP header fields in the output packet buffer.
@@ -60,6 +95,7 @@ void initIgmp(void) {
     k_set_rcvbuf(256*1024,48*1024); /* lots of input buffering        */
     k_set_ttl(1);       /* restrict multicasts to one hop */
     k_set_loop(false);      /* disable multicast loopback     */
+    k_set_pktinfo(true);    /* tell the receiving interface   */
 
     ip         = (struct ip *)send_buf;
     memset(ip, 0, sizeof(struct ip));
@@ -78,6 +114,86 @@ void initIgmp(void) {
     allhosts_group   = htonl(INADDR_ALLHOSTS_GROUP);
     allrouters_group = htonl(INADDR_ALLRTRS_GROUP);
     alligmp3_group   = htonl(INADDR_ALLIGMPV3_GROUP);
+
+    updateIgmpFilter();
+}
+
+/*
+ * Attaches a socket filter to the IGMP socket, so the kernel drops
+ * what acceptIgmp() would throw away anyway: non IGMP packets, SSDP
+ * traffic, packets whose length does not match their IP header, IGMP
+ * types that are not handled and packets from the own addresses.
+ * Kernel upcalls, whose protocol field is 0, always pass. The filter
+ * is attached again when the own addresses change.
+ */
+void updateIgmpFilter(void) {
+#ifdef HAVE_LINUX_FILTER_H
+    struct sock_filter prog[32 + MAX_IF];
+    struct sock_fprog fprog;
+    struct IfDesc *Dp;
+    uint32_t addrs[MAX_IF];
+    int naddrs = 0, n = 0, i, accept, drop;
+    unsigned Ix;
+
+    for (Ix = 0; (Dp = getIfByIx(Ix)); Ix++) {
+        if (Dp->InAdr.s_addr != 0 && naddrs < MAX_IF)
+            addrs[naddrs++] = Dp->InAdr.s_addr;
+    }
+    if (naddrs == filterAddrCount && memcmp(addrs, filterAddrs, naddrs * sizeof(addrs[0])) == 0)
+        return;
+
+    // The own addresses are checked from instruction 18 on, then come accept and drop.
+    accept = 19 + naddrs;
+    drop   = accept + 1;
+#define JUMP(to)    ((to) - n - 1)
+
+    // Kernel upcalls pass, and only IGMP besides them...
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, JUMP(accept), 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IGMP, 0, JUMP(drop)); n++;
+
+    // ...not to SSDP...
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xEFFFFFFA, JUMP(drop), 0); n++;
+
+    // ...with the IP length matching the packet...
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0); n++;
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0); n++;
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, JUMP(drop)); n++;
+
+    // ...a full IGMP header, a load beyond the packet drops it...
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0); n++;
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, IGMP_MINLEN - 1); n++;
+
+    // ...and a handled IGMP type...
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_MEMBERSHIP_QUERY, JUMP(18), 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V1_MEMBERSHIP_REPORT, JUMP(18), 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V2_MEMBERSHIP_REPORT, JUMP(18), 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V2_LEAVE_GROUP, JUMP(18), 0); n++;
+    prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V3_MEMBERSHIP_REPORT, JUMP(18), 0); n++;
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0); n++;
+
+    // ...from someone else.
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12); n++;
+    for (i = 0; i < naddrs; i++) {
+        prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(addrs[i]), JUMP(drop), 0); n++;
+    }
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, RECV_BUF_SIZE); n++;
+    prog[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0); n++;
+#undef JUMP
+
+    fprog.len    = n;
+    fprog.filter = prog;
+    if (setsockopt(MRouterFD, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        my_log(LOG_WARNING, errno, "setsockopt SO_ATTACH_FILTER");
+        return;
+    }
+    memcpy(filterAddrs, addrs, naddrs * sizeof(addrs[0]));
+    filterAddrCount = naddrs;
+    my_log(LOG_DEBUG, 0, "Attached IGMP socket filter of %d instructions.", n);
+#endif
 }
 
 /**
@@ -99,12 +215,82 @@ static const char *igmpPacketKind(unsigned int type, unsigned int code) {
     }
 }
 
+/*
+ * Encodes a value into the IGMPv3 Max Resp Code or QQIC format. Values
+ * from 128 and up use the floating point form (RFC 3376 4.1.1).
+ */
+static uint8_t igmpv3Code(unsigned value) {
+    unsigned exp;
+
+    if (value < 128)
+        return value;
+
+    for (exp = 0; exp < 8; exp++) {
+        if ((value >> (exp + 3)) < 0x20)
+            return 0x80 | (exp << 4) | ((value >> (exp + 3)) & 0x0f);
+    }
+    return 0xff;
+}
+
+/*
+ * Decodes an IGMPv3 Max Resp Code or QQIC value (RFC 3376 4.1.1).
+ */
+static unsigned igmpv3Decode(uint8_t code) {
+    if (code < 128)
+        return code;
+    return ((code & 0x0f) | 0x10) << (((code >> 4) & 0x07) + 3);
+}
+
+/*
+ * Receives an IGMP packet into the input packet buffer. The kernel
+ * index of the interface it came in on is stored in 'ifindex', or 0
+ * if the kernel does not tell.
+ */
+int recvIgmp(unsigned *ifindex) {
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        struct cmsghdr hdr;
+        char buf[256];
+    } control;
+    int recvlen;
+#ifdef IP_PKTINFO
+    struct cmsghdr *cmsg;
+    struct in_pktinfo pktinfo;
+#endif
+
+    iov.iov_base = recv_buf;
+    iov.iov_len  = RECV_BUF_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *ifindex = 0;
+    recvlen = recvmsg(MRouterFD, &msg, 0);
+    if (recvlen < 0)
+        return recvlen;
+
+#ifdef IP_PKTINFO
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+            *ifindex = pktinfo.ipi_ifindex;
+        }
+    }
+#endif
+    return recvlen;
+}
+
 /**
  * Process a newly received IGMP packet that is sitting in the input
- * packet buffer.
+ * packet buffer. 'ifindex' is the kernel index of the interface it
+ * came in on, or 0 if not known.
  */
-void acceptIgmp(int recvlen) {
+void acceptIgmp(int recvlen, unsigned ifindex) {
     register uint32_t src, dst, group;
+    struct IfDesc *sourceVif;
     struct ip *ip;
     struct igmp *igmp;
     struct igmpv3_report *igmpv3;
@@ -140,10 +326,28 @@ void acceptIgmp(int recvlen) {
         else {
             struct IfDesc *checkVIF;
 
+            // The upstream the kernel routes the source over is the reverse path...
+            i = rpfUpstream(src);
+            if(i != -1 && upstreamUsable(i)) {
+                checkVIF = getIfByIx( upStreamIfIdx[i] );
+                if(src != checkVIF->InAdr.s_addr) {
+                    my_log(LOG_DEBUG, 0, "Route activate request from %s to %s on VIF[%d] by reverse path",
+                        inetFmt(src,s1), inetFmt(dst,s2), checkVIF->index);
+                    activateRoute(dst, src, checkVIF->index);
+                    return;
+                }
+            }
+
+            // ...else check the configured networks of the upstreams.
             for(i=0; i<MAX_UPS_VIFS; i++)
             {
                 if(-1 != upStreamIfIdx[i])
                 {
+                    // Traffic from a dead upstream is not routed.
+                    if(!upstreamUsable(i)) {
+                        continue;
+                    }
+
                     // Check if the source address matches a valid address on upstream vif.
                     checkVIF = getIfByIx( upStreamIfIdx[i] );
                     if(checkVIF == 0) {
@@ -199,15 +403,24 @@ void acceptIgmp(int recvlen) {
         return;
     }
 
+    // Hosts over their report rate are dropped before any other work...
+    if (igmp->igmp_type != IGMP_MEMBERSHIP_QUERY && !allowReport(src))
+        return;
+
     my_log(LOG_NOTICE, 0, "RECV %s from %-15s to %s",
         igmpPacketKind(igmp->igmp_type, igmp->igmp_code),
         inetFmt(src, s1), inetFmt(dst, s2) );
 
+    // The interface the kernel says the packet came in on, else the one of the sender's subnet.
+    sourceVif = ifindex ? getIfByIfIndex(ifindex, src) : NULL;
+    if (sourceVif == NULL)
+        sourceVif = getIfByAddress(src);
+
     switch (igmp->igmp_type) {
     case IGMP_V1_MEMBERSHIP_REPORT:
     case IGMP_V2_MEMBERSHIP_REPORT:
         group = igmp->igmp_group.s_addr;
-        acceptGroupReport(src, group);
+        acceptGroupReport(sourceVif, src, group);
         return;
 
     case IGMP_V3_MEMBERSHIP_REPORT:
@@ -219,19 +432,16 @@ void acceptIgmp(int recvlen) {
                 break;
             group = grec->grec_mca.s_addr;
             nsrcs = ntohs(grec->grec_nsrcs);
+            if ((uint8_t *)igmpv3 + ipdatalen < (uint8_t *)&grec->grec_src[nsrcs])
+                break;
             switch (grec->grec_type) {
             case IGMPV3_MODE_IS_INCLUDE:
             case IGMPV3_CHANGE_TO_INCLUDE:
-                if (nsrcs == 0) {
-                    acceptLeaveMessage(src, group);
-                    break;
-                } /* else fall through */
             case IGMPV3_MODE_IS_EXCLUDE:
             case IGMPV3_CHANGE_TO_EXCLUDE:
             case IGMPV3_ALLOW_NEW_SOURCES:
-                acceptGroupReport(src, group);
-                break;
             case IGMPV3_BLOCK_OLD_SOURCES:
+                acceptGroupRecord(sourceVif, src, group, grec->grec_type, nsrcs, grec->grec_src);
                 break;
             default:
                 my_log(LOG_INFO, 0,
@@ -247,10 +457,18 @@ void acceptIgmp(int recvlen) {
 
     case IGMP_V2_LEAVE_GROUP:
         group = igmp->igmp_group.s_addr;
-        acceptLeaveMessage(src, group);
+        acceptLeaveMessage(sourceVif, src, group);
         return;
 
     case IGMP_MEMBERSHIP_QUERY:
+        group = igmp->igmp_group.s_addr;
+        if (ipdatalen == IGMP_MINLEN) {
+            // IGMPv1 queries have no max response time.
+            acceptMembershipQuery(sourceVif, src, group, igmp->igmp_code ? 2 : 1,
+                igmp->igmp_code ? igmp->igmp_code : INTERVAL_QUERY_RESPONSE * IGMP_TIMER_SCALE);
+        } else if (ipdatalen >= IGMPV3_MINLEN) {
+            acceptMembershipQuery(sourceVif, src, group, 3, igmpv3Decode(igmp->igmp_code));
+        }
         return;
 
     default:
@@ -295,21 +513,51 @@ static void buildIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t g
     igmp->igmp_group.s_addr = group;
     igmp->igmp_cksum        = 0;
     igmp->igmp_cksum        = inetChksum((unsigned short *)igmp,
-                                         IP_HEADER_RAOPT_LEN + datalen);
+                                         IGMP_MINLEN + datalen);
 
 }
 
 /*
- * Call build_igmp() to build an IGMP message in the output packet buffer.
- * Then send the message from the interface with IP address 'src' to
- * destination 'dst'.
+ * Takes one packet from the budget of the interface with address src
+ * for the current second. Returns 0 if the budget is used up.
  */
-void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen) {
+static int paceTake(uint32_t src) {
+    struct Config *conf = getCommonConfig();
+    struct PaceState *ps;
+    time_t now;
+    int i;
+
+    if (conf->igmpPacing == 0)
+        return 1;
+
+    for (i = 0, ps = NULL; i < MAX_IF; i++) {
+        if (paceStates[i].src == src || paceStates[i].src == 0) {
+            ps = &paceStates[i];
+            break;
+        }
+    }
+    if (ps == NULL)
+        return 1;
+
+    now = monotonicTime();
+    if (ps->src != src || ps->second != now) {
+        ps->src    = src;
+        ps->second = now;
+        ps->sent   = 0;
+    }
+    if (ps->sent >= conf->igmpPacing)
+        return 0;
+    ps->sent++;
+    return 1;
+}
+
+/*
+ * Puts a packet on the wire.
+ */
+static void transmitIgmp(uint32_t src, uint32_t dst, int type, int code, char *buf, int len) {
     struct sockaddr_in sdst;
     int setloop = 0, setigmpsource = 0;
 
-    buildIgmp(src, dst, type, code, group, datalen);
-
     if (IN_MULTICAST(ntohl(dst))) {
         k_set_if(src);
         setigmpsource = 1;
@@ -325,8 +573,7 @@ void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, in
     sdst.sin_len = sizeof(sdst);
 #endif
     sdst.sin_addr.s_addr = dst;
-    if (sendto(MRouterFD, send_buf,
-               IP_HEADER_RAOPT_LEN + IGMP_MINLEN + datalen, 0,
+    if (sendto(MRouterFD, buf, len, 0,
                (struct sockaddr *)&sdst, sizeof(sdst)) < 0) {
         if (errno == ENETDOWN)
             my_log(LOG_ERR, errno, "Sender VIF was down.");
@@ -348,3 +595,114 @@ void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, in
         igmpPacketKind(type, code),
         src == INADDR_ANY ? "INADDR_ANY" : inetFmt(src, s1), inetFmt(dst, s2));
 }
+
+/*
+ * Sends the queued packets that fit in the budget of their interface,
+ * and reschedules itself while packets are left.
+ */
+static void drainPacedIgmp(void *arg) {
+    struct PacedPacket **pp, *p;
+
+    (void)arg;
+    drainScheduled = 0;
+
+    for (pp = &pacedHead; (p = *pp) != NULL; ) {
+        if (paceTake(p->src)) {
+            *pp = p->next;
+            transmitIgmp(p->src, p->dst, p->type, p->code, p->buf, p->len);
+            free(p);
+            pacedCount--;
+        } else {
+            pp = &p->next;
+        }
+    }
+    pacedTail = pp;
+
+    if (pacedHead != NULL) {
+        timer_setTimer(1, drainPacedIgmp, NULL);
+        drainScheduled = 1;
+    }
+}
+
+/*
+ * Call build_igmp() to build an IGMP message in the output packet buffer.
+ * Then send the message from the interface with IP address 'src' to
+ * destination 'dst'. The message is queued instead if the interface has
+ * used up its budget, or already has packets waiting.
+ */
+void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen) {
+    struct PacedPacket *p;
+    int len = IP_HEADER_RAOPT_LEN + IGMP_MINLEN + datalen;
+
+    buildIgmp(src, dst, type, code, group, datalen);
+
+    for (p = pacedHead; p != NULL; p = p->next) {
+        if (p->src == src)
+            break;
+    }
+    if (p == NULL && paceTake(src)) {
+        transmitIgmp(src, dst, type, code, send_buf, len);
+        return;
+    }
+
+    if (pacedCount >= MAX_PACED_PACKETS) {
+        my_log(LOG_WARNING, 0, "IGMP send queue full. Dropping %s to %s.",
+            igmpPacketKind(type, code), inetFmt(dst, s1));
+        return;
+    }
+
+    p = (struct PacedPacket *)malloc(sizeof(struct PacedPacket) + len);
+    if (p == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    p->next = NULL;
+    p->src  = src;
+    p->dst  = dst;
+    p->type = type;
+    p->code = code;
+    p->len  = len;
+    memcpy(p->buf, send_buf, len);
+
+    *pacedTail = p;
+    pacedTail  = &p->next;
+    pacedCount++;
+
+    if (!drainScheduled) {
+        timer_setTimer(1, drainPacedIgmp, NULL);
+        drainScheduled = 1;
+    }
+}
+
+/*
+ * Builds an IGMPv3 membership query and sends it from the interface
+ * with IP address 'src'. A zero 'group' makes a general query, and
+ * any sources make it group-and-source specific. 'maxresp' is given
+ * in tenths of a second. Source lists that don't fit in one packet
+ * are split over several queries.
+ */
+void sendIgmpV3Query(uint32_t src, uint32_t dst, uint32_t group, unsigned maxresp,
+                     int suppress, int nsrcs, uint32_t *sources) {
+    struct Config *conf = getCommonConfig();
+    struct igmpv3_query *query;
+    int n, i;
+
+    query = (struct igmpv3_query *)(send_buf + IP_HEADER_RAOPT_LEN);
+
+    do {
+        n = nsrcs < (int)IGMPV3_MAX_QUERY_SRCS ? nsrcs : (int)IGMPV3_MAX_QUERY_SRCS;
+
+        query->igmp_misc   = IGMPV3_QUERY_QRV(conf->robustnessValue > 7 ? 0 : conf->robustnessValue);
+        if (suppress)
+            query->igmp_misc |= IGMPV3_QUERY_SFLAG;
+        query->igmp_qqi    = igmpv3Code(conf->queryInterval);
+        query->igmp_numsrc = htons(n);
+        for (i = 0; i < n; i++)
+            query->igmp_sources[i].s_addr = sources[i];
+
+        sendIgmp(src, dst, IGMP_MEMBERSHIP_QUERY, igmpv3Code(maxresp), group,
+                 IGMPV3_MINLEN - IGMP_MINLEN + n * sizeof(struct in_addr));
+
+        sources += n;
+        nsrcs   -= n;
+    } while (nsrcs > 0);
+}
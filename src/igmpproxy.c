@@ -178,6 +178,7 @@ int igmpProxyInit(void) {
     sigemptyset(&sa.sa_mask);
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
 
     // Loads configuration for Physical interfaces...
     buildIfVc();
@@ -231,12 +232,23 @@ int igmpProxyInit(void) {
         }
     }
 
+    // Seed the random delays of reports and queries.
+    srandom(time(NULL) ^ getpid());
+
     // Initialize IGMP
     initIgmp();
     // Initialize Routing table
     initRouteTable();
     // Initialize timer
     callout_init();
+    // Watch the upstream links
+    initUpstreamMonitor();
+    // Follow the unicast routes for reverse path lookups
+    initRpf();
+    // Install the static groups
+    installStaticGroups();
+    // Start pre-joining popular groups
+    initPreJoin();
 
     return 1;
 }
@@ -248,7 +260,10 @@ void igmpProxyCleanUp(void) {
     my_log( LOG_DEBUG, 0, "clean handler called" );
 
     free_all_callouts();    // No more timeouts.
+    savePreJoin();          // Keep the group popularity.
     clearAllRoutes();       // Remove all routes.
+    clearSourceFilters();   // Remove IGMPv3 source filter state.
+    flushUpstreamReports(); // Send the upstream leaves.
     disableMRouter();       // Disable the multirout API
 }
 
@@ -260,9 +275,9 @@ void igmpProxyRun(void) {
     struct Config *config = getCommonConfig();
     // Set some needed values.
     register int recvlen;
-    int     MaxFD, Rt, secs;
+    int     MaxFD, LinkFD, RpfFD, Rt, secs;
     fd_set  ReadFDS;
-    socklen_t dummy = 0;
+    unsigned ifindex;
     struct  timespec  curtime, lasttime, difftime, tv;
     // The timeout is a pointer in order to set it to NULL if nessecary.
     struct  timespec  *timeout = &tv;
@@ -285,6 +300,12 @@ void igmpProxyRun(void) {
                 my_log(LOG_NOTICE, 0, "Got a interrupt signal. Exiting.");
                 break;
             }
+            if (sighandled & GOT_SIGUSR1) {
+                sighandled &= ~GOT_SIGUSR1;
+                logReportLimits();
+                logGroupCaps();
+                logBandwidth();
+            }
         }
 
         /* aimwang: call rebuildIfVc */
@@ -302,9 +323,19 @@ void igmpProxyRun(void) {
 
         // Prepare for select.
         MaxFD = MRouterFD;
+        LinkFD = getUpstreamLinkSock();
+        RpfFD = getRpfSock();
 
         FD_ZERO( &ReadFDS );
         FD_SET( MRouterFD, &ReadFDS );
+        if( LinkFD >= 0 ) {
+            FD_SET( LinkFD, &ReadFDS );
+            if( LinkFD > MaxFD ) MaxFD = LinkFD;
+        }
+        if( RpfFD >= 0 ) {
+            FD_SET( RpfFD, &ReadFDS );
+            if( RpfFD > MaxFD ) MaxFD = RpfFD;
+        }
 
         // wait for input
         Rt = pselect( MaxFD +1, &ReadFDS, NULL, NULL, timeout, NULL );
@@ -316,17 +347,24 @@ void igmpProxyRun(void) {
         }
         else if( Rt > 0 ) {
 
+            // Handle upstream link state changes first...
+            if( LinkFD >= 0 && FD_ISSET( LinkFD, &ReadFDS ) ) {
+                acceptUpstreamLinkEvent();
+            }
+            if( RpfFD >= 0 && FD_ISSET( RpfFD, &ReadFDS ) ) {
+                acceptRpfEvent();
+            }
+
             // Read IGMP request, and handle it...
             if( FD_ISSET( MRouterFD, &ReadFDS ) ) {
 
-                recvlen = recvfrom(MRouterFD, recv_buf, RECV_BUF_SIZE,
-                                   0, NULL, &dummy);
+                recvlen = recvIgmp(&ifindex);
                 if (recvlen < 0) {
-                    if (errno != EINTR) my_log(LOG_ERR, errno, "recvfrom");
+                    if (errno != EINTR) my_log(LOG_ERR, errno, "recvmsg");
                     continue;
                 }
 
-                acceptIgmp(recvlen);
+                acceptIgmp(recvlen, ifindex);
             }
         }
 
@@ -374,15 +412,14 @@ static void signalHandler(int sig) {
     case SIGTERM:
         sighandled |= GOT_SIGINT;
         break;
+    case SIGUSR1:
+        sighandled |= GOT_SIGUSR1;
+        break;
         /* XXX: Not in use.
         case SIGHUP:
             sighandled |= GOT_SIGHUP;
             break;
 
-        case SIGUSR1:
-            sighandled |= GOT_SIGUSR1;
-            break;
-
         case SIGUSR2:
             sighandled |= GOT_SIGUSR2;
             break;
@@ -114,6 +114,7 @@ void my_log( int Serverity, int Errno, const char *FmtSt, ... );
 /* ifvc.c
  */
 #define MAX_IF         40     // max. number of interfaces recognized
+#define MAX_ORIGINS    4      // max. number of sources kept per route
 
 // Interface states
 #define IF_STATE_DISABLED      0   // Interface should be ignored.
@@ -126,6 +127,7 @@ void my_log( int Serverity, int Errno, const char *FmtSt, ... );
 #define DEFAULT_ROBUSTNESS     2
 #define DEFAULT_THRESHOLD      1
 #define DEFAULT_RATELIMIT      0
+#define DEFAULT_IGMP_PACING    100
 
 // Define timer constants (in seconds...)
 #define INTERVAL_QUERY          125
@@ -134,7 +136,6 @@ void my_log( int Serverity, int Errno, const char *FmtSt, ... );
 
 #define ROUTESTATE_NOTJOINED            0   // The group corresponding to route is not joined
 #define ROUTESTATE_JOINED               1   // The group corresponding to route is joined
-#define ROUTESTATE_CHECK_LAST_MEMBER    2   // The router is checking for hosts
 
 
 
@@ -145,6 +146,12 @@ struct SubnetList {
     struct SubnetList   *next;
 };
 
+// A range of groups, in host byte order...
+struct GroupRange {
+    uint32_t            first;
+    uint32_t            last;
+};
+
 struct IfDesc {
     char                Name[IF_NAMESIZE];
     struct in_addr      InAdr;          /* == 0 for non IP interfaces */
@@ -152,10 +159,20 @@ struct IfDesc {
     short               state;
     struct SubnetList*  allowednets;
     struct SubnetList*  allowedgroups;
+    struct GroupRange*  groupRanges; /* allowedgroups as sorted, disjoint ranges */
+    unsigned int        groupRangeCount;
     unsigned int        robustness;
     unsigned char       threshold;   /* ttl limit */
     unsigned int        ratelimit;
     unsigned int        index;
+    unsigned short      fastleave;   /* remove groups when the last known host leaves */
+    unsigned int        maxGroups;   /* cap on groups with known members, 0 for none */
+    unsigned int        hostMaxGroups; /* cap on groups per known host, 0 for none */
+    unsigned int        bandwidth;   /* budget of the listened groups in kbit/s, 0 for none */
+    uint32_t            querier;     /* address of the elected querier, 0 when it is us */
+    time_t              querierExpires; /* other querier present timer */
+    unsigned int        ifIndex;     /* kernel interface index */
+    struct LpmNode*     netTrie;     /* allowednets as a prefix trie */
 };
 
 // Keeps common configuration settings
@@ -177,6 +194,28 @@ struct Config {
     // Set if not detect new interface for down stream.
     unsigned short	defaultInterfaceState;	// 0: disable, 2: downstream
     //~ aimwang added done
+    // Set if the proxy should send its own IGMPv3 reports upstream.
+    unsigned short      upstreamReports;
+    // Max IGMP packets sent per second on an interface, 0 for no limit.
+    unsigned int        igmpPacing;
+    // Target leave detection time for adaptive query timers, 0 when not adaptive.
+    unsigned int        adaptiveLatency;
+    // Seconds a group stays joined upstream after its last listener left.
+    unsigned int        holdDown;
+    // Number of popular groups kept joined upstream, 0 when not pre-joining.
+    unsigned int        prejoinCount;
+    // Bandwidth budget for the pre-joined groups in kbit/s, 0 for no limit.
+    unsigned int        prejoinBudget;
+    // File the group popularity is saved in, or NULL.
+    char                *prejoinFile;
+    // Set if groups are joined on every upstream, instead of one selected per group.
+    unsigned short      joinAllUpstreams;
+    // Seconds without upstream queries before an upstream is given up, 0 to not check.
+    unsigned int        upstreamTimeout;
+    // Reports and leaves per second accepted from each host, 0 for no limit.
+    unsigned int        reportLimitRate;
+    // Reports a host may send in a burst above its rate.
+    unsigned int        reportLimitBurst;
 };
 
 // Holds the indeces of the upstream IF...
@@ -190,7 +229,10 @@ struct IfDesc *getIfByName( const char *IfName );
 struct IfDesc *getIfByIx( unsigned Ix );
 struct IfDesc *getIfByAddress( uint32_t Ix );
 struct IfDesc *getIfByVifIndex( unsigned vifindex );
+struct IfDesc *getIfByIfIndex( unsigned ifindex, uint32_t src );
 int isAdressValidForIf(struct IfDesc* intrface, uint32_t ipaddr);
+int isGroupAllowedForIf(struct IfDesc* intrface, uint32_t group);
+void invalidateIfAddresses( void );
 
 /* mroute-api.c
  */
@@ -210,13 +252,27 @@ void addVIF( struct IfDesc *Dp );
 void delVIF( struct IfDesc *Dp );
 int addMRoute( struct MRouteDesc * Dp );
 int delMRoute( struct MRouteDesc * Dp );
+int getMRouteBytes( struct MRouteDesc *Dp, unsigned long *bytes );
 int getVifIx( struct IfDesc *IfDp );
 
 /* config.c
  */
+// A group pinned to downstream interfaces by a staticgroup stanza.
+struct StaticGroup {
+    struct StaticGroup  *next;
+    uint32_t            group;
+    int                 nsources;
+    uint32_t            sources[MAX_ORIGINS];
+    int                 nifs;
+    char                *ifnames[MAX_IF];
+};
+
 int loadConfig(char *configFile);
 void configureVifs(void);
 struct Config *getCommonConfig(void);
+struct StaticGroup *getStaticGroups(void);
+int getSsmSources(uint32_t group, uint32_t *sources);
+unsigned int getGroupBitrate(uint32_t group, int *priority);
 
 /* igmp.c
 */
@@ -224,8 +280,12 @@ extern uint32_t allhosts_group;
 extern uint32_t allrouters_group;
 extern uint32_t alligmp3_group;
 void initIgmp(void);
-void acceptIgmp(int);
+void updateIgmpFilter(void);
+int recvIgmp(unsigned *ifindex);
+void acceptIgmp(int recvlen, unsigned ifindex);
 void sendIgmp (uint32_t, uint32_t, int, int, uint32_t,int);
+void sendIgmpV3Query(uint32_t src, uint32_t dst, uint32_t group, unsigned maxresp,
+                     int suppress, int nsrcs, uint32_t *sources);
 
 /* lib.c
  */
@@ -233,6 +293,7 @@ char   *fmtInAdr( char *St, struct in_addr InAdr );
 char   *inetFmt(uint32_t addr, char *s);
 char   *inetFmts(uint32_t addr, uint32_t mask, char *s);
 uint16_t inetChksum(uint16_t *addr, int len);
+time_t  monotonicTime(void);
 
 /* kern.c
  */
@@ -241,6 +302,7 @@ void k_hdr_include(int hdrincl);
 void k_set_ttl(int t);
 void k_set_loop(int l);
 void k_set_if(uint32_t ifa);
+void k_set_pktinfo(int on);
 /*
 void k_join(uint32_t grp, uint32_t ifa);
 void k_leave(uint32_t grp, uint32_t ifa);
@@ -254,6 +316,8 @@ int openUdpSocket( uint32_t PeerInAdr, uint16_t PeerPort );
  */
 int joinMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr );
 int leaveMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr );
+int joinMcSourceGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr, uint32_t source );
+int leaveMcSourceGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr, uint32_t source );
 
 
 /* rttable.c
@@ -261,18 +325,84 @@ int leaveMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr );
 void initRouteTable(void);
 void clearAllRoutes(void);
 int insertRoute(uint32_t group, int ifx);
+int refreshRouteAge(uint32_t group, int ifx);
 int activateRoute(uint32_t group, uint32_t originAddr, int upstrVif);
 void ageActiveRoutes(void);
-void setRouteLastMemberMode(uint32_t group);
-int lastMemberGroupAge(uint32_t group);
+void setRouteLastMemberMode(uint32_t group, int ifx);
+int lastMemberGroupAge(uint32_t group, int ifx, int final);
 int interfaceInRoute(int32_t group, int Ix);
+void removeRouteVif(uint32_t group, int ifx);
+void refreshRoute(uint32_t group);
+void setRoutePreJoin(uint32_t group, int on);
+void installStaticGroups(void);
+void preinstallRoute(uint32_t group, int nsrcs, uint32_t *sources);
+int getRouteBytes(uint32_t group, unsigned long *bytes);
+int migrateUpstream(int upstream);
+int replayUpstream(int upstream);
+void logBandwidth(void);
 int getMcGroupSock(void);
 
+/* srctable.c
+ */
+int updateSourceFilter(uint32_t group, int vif, int type, int nsrcs, struct in_addr *sources);
+int hasSourceFilter(uint32_t group, int vif);
+int sourceFilterForwards(uint32_t group, int vif, uint32_t source);
+int sourceFilterSuppress(uint32_t group, int vif, uint32_t source);
+void clearSourceFilter(uint32_t group, int vif);
+void clearSourceFilters(void);
+
 /* request.c
  */
-void acceptGroupReport(uint32_t src, uint32_t group);
-void acceptLeaveMessage(uint32_t src, uint32_t group);
+void acceptGroupReport(struct IfDesc *sourceVif, uint32_t src, uint32_t group);
+void acceptGroupRecord(struct IfDesc *sourceVif, uint32_t src, uint32_t group, int type,
+                       int nsrcs, struct in_addr *sources);
+void acceptLeaveMessage(struct IfDesc *sourceVif, uint32_t src, uint32_t group);
+void acceptMembershipQuery(struct IfDesc *sourceVif, uint32_t src, uint32_t group,
+                           int version, unsigned maxresp);
 void sendGeneralMembershipQuery(void);
+void sendGroupSourceQuery(uint32_t group, int vif, int nsrcs, uint32_t *sources);
+void logGroupCaps(void);
+void forgetGroupOnVif(uint32_t group, int vif);
+
+/* report.c
+ */
+void reportUpstreamMembership(struct IfDesc *upstrIf, uint32_t group, int join,
+                              int nsrcs, uint32_t *sources);
+void acceptUpstreamQuery(struct IfDesc *upstrIf, uint32_t group, int version, unsigned maxresp);
+void flushUpstreamReports(void);
+
+/* prejoin.c
+ */
+void initPreJoin(void);
+void notePopularity(uint32_t group);
+void savePreJoin(void);
+
+/* limit.c
+ */
+int allowReport(uint32_t host);
+void logReportLimits(void);
+
+/* upstream.c
+ */
+void initUpstreamMonitor(void);
+int getUpstreamLinkSock(void);
+void acceptUpstreamLinkEvent(void);
+void noteUpstreamQuery(struct IfDesc *Dp);
+int upstreamUsable(int upstream);
+
+/* lpm.c
+ */
+struct LpmNode;
+void lpmInsert(struct LpmNode **root, uint32_t prefix, int len, int value);
+int lpmLookup(struct LpmNode *root, uint32_t addr, int *value);
+void lpmFree(struct LpmNode **root);
+
+/* rpf.c
+ */
+void initRpf(void);
+int rpfUpstream(uint32_t src);
+int getRpfSock(void);
+void acceptRpfEvent(void);
 
 /* callout.c 
 */
@@ -288,7 +418,7 @@ int timer_leftTimer(int);
 
 /* confread.c
  */
-#define MAX_TOKEN_LENGTH    30
+#define MAX_TOKEN_LENGTH    256
 
 int openConfigFile(char *filename);
 void closeConfigFile(void);
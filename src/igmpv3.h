@@ -29,6 +29,17 @@ struct igmpv3_grec {
     struct in_addr grec_src[0];
 };
 
+struct igmpv3_query {
+    u_int8_t igmp_type;
+    u_int8_t igmp_code;
+    u_int16_t igmp_cksum;
+    struct in_addr igmp_group;
+    u_int8_t igmp_misc;
+    u_int8_t igmp_qqi;
+    u_int16_t igmp_numsrc;
+    struct in_addr igmp_sources[0];
+};
+
 struct igmpv3_report {
     u_int8_t igmp_type;
     u_int8_t igmp_resv1;
@@ -46,3 +57,13 @@ struct igmpv3_report {
 #define IGMPV3_BLOCK_OLD_SOURCES 6
 
 #define IGMPV3_MINLEN 12
+
+// Query flags and limits
+#define IGMPV3_QUERY_SFLAG  0x08
+#define IGMPV3_QUERY_QRV(x) ((x) & 0x07)
+#define IGMPV3_MAX_QUERY_SRCS \
+    ((MAX_IP_PACKET_LEN - IP_HEADER_RAOPT_LEN - IGMPV3_MINLEN) / sizeof(struct in_addr))
+
+// Router side filter modes of a group (RFC 3376 6.2.1)
+#define IGMPV3_FMODE_INCLUDE 1
+#define IGMPV3_FMODE_EXCLUDE 2
@@ -111,6 +111,14 @@ void k_set_if(uint32_t ifa) {
             inetFmt(ifa, s1));
 }
 
+void k_set_pktinfo(int on) {
+#ifdef IP_PKTINFO
+    if (setsockopt(MRouterFD, IPPROTO_IP, IP_PKTINFO,
+                   (char *)&on, sizeof(on)) < 0)
+        my_log(LOG_WARNING, errno, "setsockopt IP_PKTINFO %u", on);
+#endif
+}
+
 /*
 void k_join(uint32_t grp, uint32_t ifa) {
     struct ip_mreq mreq;
@@ -143,3 +143,13 @@ uint16_t inetChksum(uint16_t *addr, int len) {
     answer = ~sum;                      /* truncate to 16 bits */
     return(answer);
 }
+
+/*
+ * Returns the current time in seconds from a monotonic clock.
+ */
+time_t monotonicTime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,193 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   limit.c
+*
+*   Rate limits the membership reports and leaves of each host with
+*   a token bucket, so a single host can't keep the proxy busy. The
+*   buckets live in a hash, and buckets that have filled up again
+*   carry no state and are aged out. When the hash is full, the hosts
+*   without a bucket share one.
+*/
+
+#include "igmpproxy.h"
+
+#define LIMIT_HASH_SIZE     1024
+#define MAX_LIMITED_HOSTS   4096
+#define LIMIT_AGE_INTERVAL  60      // Seconds between aging runs
+#define TOKEN_SCALE         1000    // Tokens per report
+
+/**
+*   The token bucket of a host.
+*/
+struct ReportBucket {
+    struct ReportBucket *next;
+    uint32_t            host;
+    unsigned long       tokens;     // Available reports, in 1/TOKEN_SCALE
+    long long           refilled;   // Milliseconds of the last refill
+    unsigned long       dropped;    // Reports dropped from the host
+};
+
+static struct ReportBucket  *buckets[LIMIT_HASH_SIZE];
+static struct ReportBucket  overflow;   // Shared by hosts that got no bucket
+static unsigned             hostCount;
+static unsigned long        totalDropped;
+static int                  agingScheduled;
+
+/**
+*   Returns the monotonic time in milliseconds.
+*/
+static long long monotonicMillis(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+*   Adds the tokens earned since the last refill to a bucket.
+*/
+static void refillBucket(struct ReportBucket *rb, long long now) {
+    struct Config   *conf = getCommonConfig();
+    unsigned long   full = conf->reportLimitBurst * TOKEN_SCALE;
+    long long       earned = (now - rb->refilled) * conf->reportLimitRate;
+
+    // The rate is per second, and a second has TOKEN_SCALE milliseconds.
+    rb->tokens = earned >= (long long)(full - rb->tokens) ? full : rb->tokens + earned;
+    rb->refilled = now;
+}
+
+/**
+*   Removes the buckets that are full again. Runs every
+*   LIMIT_AGE_INTERVAL seconds while there are buckets.
+*/
+static void ageReportBuckets(void *arg) {
+    struct Config       *conf = getCommonConfig();
+    struct ReportBucket *rb, **rbp;
+    long long           now = monotonicMillis();
+    unsigned            bucket;
+
+    (void)arg;
+    agingScheduled = 0;
+
+    for(bucket = 0; bucket < LIMIT_HASH_SIZE; bucket++) {
+        for(rbp = &buckets[bucket]; (rb = *rbp) != NULL; ) {
+            refillBucket(rb, now);
+            if(rb->tokens == conf->reportLimitBurst * TOKEN_SCALE) {
+                *rbp = rb->next;
+                free(rb);
+                hostCount--;
+            } else {
+                rbp = &rb->next;
+            }
+        }
+    }
+
+    if(hostCount > 0) {
+        timer_setTimer(LIMIT_AGE_INTERVAL, ageReportBuckets, NULL);
+        agingScheduled = 1;
+    }
+}
+
+/**
+*   Finds the bucket of a host, or creates a full one.
+*/
+static struct ReportBucket *findReportBucket(uint32_t host, long long now) {
+    struct Config       *conf = getCommonConfig();
+    struct ReportBucket *rb;
+    unsigned            bucket = (ntohl(host) * 2654435761u) % LIMIT_HASH_SIZE;
+
+    for(rb = buckets[bucket]; rb != NULL; rb = rb->next) {
+        if(rb->host == host) {
+            return rb;
+        }
+    }
+
+    if(hostCount >= MAX_LIMITED_HOSTS) {
+        return &overflow;
+    }
+    rb = (struct ReportBucket*) malloc(sizeof(struct ReportBucket));
+    if(rb == NULL) {
+        return &overflow;
+    }
+    rb->host     = host;
+    rb->tokens   = conf->reportLimitBurst * TOKEN_SCALE;
+    rb->refilled = now;
+    rb->dropped  = 0;
+    rb->next     = buckets[bucket];
+    buckets[bucket] = rb;
+    hostCount++;
+
+    if(!agingScheduled) {
+        timer_setTimer(LIMIT_AGE_INTERVAL, ageReportBuckets, NULL);
+        agingScheduled = 1;
+    }
+    return rb;
+}
+
+/**
+*   Takes a token for a report or leave from a host. Returns 1 if
+*   the report may be handled, or 0 if the host is over its rate.
+*/
+int allowReport(uint32_t host) {
+    struct Config       *conf = getCommonConfig();
+    struct ReportBucket *rb;
+    long long           now;
+
+    if(conf->reportLimitRate == 0) {
+        return 1;
+    }
+
+    now = monotonicMillis();
+    rb = findReportBucket(host, now);
+    refillBucket(rb, now);
+    if(rb->tokens < TOKEN_SCALE) {
+        if(rb->dropped++ == 0) {
+            my_log(LOG_NOTICE, 0, "Host %s exceeds %u reports per second. Dropping its reports.",
+                inetFmt(host, s1), conf->reportLimitRate);
+        }
+        totalDropped++;
+        return 0;
+    }
+    rb->tokens -= TOKEN_SCALE;
+    return 1;
+}
+
+/**
+*   Logs the report drop counters of the hosts that are limited.
+*/
+void logReportLimits(void) {
+    struct ReportBucket *rb;
+    unsigned            bucket;
+
+    my_log(LOG_NOTICE, 0, "Report limit: %lu reports dropped, %u hosts tracked.",
+        totalDropped, hostCount);
+    for(bucket = 0; bucket < LIMIT_HASH_SIZE; bucket++) {
+        for(rb = buckets[bucket]; rb != NULL; rb = rb->next) {
+            if(rb->dropped > 0) {
+                my_log(LOG_NOTICE, 0, "Report limit: %s dropped %lu",
+                    inetFmt(rb->host, s1), rb->dropped);
+            }
+        }
+    }
+    if(overflow.dropped > 0) {
+        my_log(LOG_NOTICE, 0, "Report limit: untracked hosts dropped %lu", overflow.dropped);
+    }
+}
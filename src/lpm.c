@@ -0,0 +1,103 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   lpm.c
+*
+*   Longest prefix match on IPv4 addresses, with a binary trie. A
+*   lookup walks one node per bit of the matched prefix, so it never
+*   takes more than 32 steps. Addresses are in network byte order,
+*   like everywhere else.
+*/
+
+#include "igmpproxy.h"
+
+/**
+*   A trie node. The path from the root gives the prefix.
+*/
+struct LpmNode {
+    struct LpmNode  *child[2];
+    short           hasValue;   // A prefix ends at this node
+    int             value;
+};
+
+/**
+*   Returns bit 'depth' of an address, counting from the most
+*   significant bit.
+*/
+static int prefixBit(uint32_t addr, int depth) {
+    return (ntohl(addr) >> (31 - depth)) & 1;
+}
+
+/**
+*   Stores a value for a prefix. An existing value for the same
+*   prefix is replaced.
+*/
+void lpmInsert(struct LpmNode **root, uint32_t prefix, int len, int value) {
+    struct LpmNode  **np = root;
+    int             depth = 0;
+
+    for(;;) {
+        if(*np == NULL) {
+            *np = (struct LpmNode *)calloc(1, sizeof(struct LpmNode));
+            if(*np == NULL) {
+                my_log(LOG_ERR, 0, "Out of memory.");
+            }
+        }
+        if(depth == len) {
+            break;
+        }
+        np = &(*np)->child[prefixBit(prefix, depth++)];
+    }
+    (*np)->hasValue = 1;
+    (*np)->value    = value;
+}
+
+/**
+*   Finds the value of the longest prefix that matches an address.
+*   Returns 1 and sets 'value' if a prefix matched, or 0 otherwise.
+*/
+int lpmLookup(struct LpmNode *root, uint32_t addr, int *value) {
+    struct LpmNode  *np;
+    int             depth = 0, found = 0;
+
+    for(np = root; np != NULL; np = np->child[prefixBit(addr, depth++)]) {
+        if(np->hasValue) {
+            *value = np->value;
+            found  = 1;
+        }
+        if(depth == 32) {
+            break;
+        }
+    }
+    return found;
+}
+
+/**
+*   Frees a trie, and leaves it empty.
+*/
+void lpmFree(struct LpmNode **root) {
+    if(*root == NULL) {
+        return;
+    }
+    lpmFree(&(*root)->child[0]);
+    lpmFree(&(*root)->child[1]);
+    free(*root);
+    *root = NULL;
+}
@@ -66,6 +66,34 @@ static int joinleave( int Cmd, int UdpSock, struct IfDesc *IfDp, uint32_t mcasta
     return 0;
 }
 
+/**
+*   Common function for joining or leaving a source of a MCast group.
+*/
+static int joinleaveSource( int Cmd, int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr, uint32_t source ) {
+    struct ip_mreq_source CtlReq;
+    const char *CmdSt = Cmd == 'j' ? "join" : "leave";
+
+    memset(&CtlReq, 0, sizeof(CtlReq));
+    CtlReq.imr_multiaddr.s_addr  = mcastaddr;
+    CtlReq.imr_interface.s_addr  = IfDp->InAdr.s_addr;
+    CtlReq.imr_sourceaddr.s_addr = source;
+
+    {
+        my_log( LOG_NOTICE, 0, "%sMcGroup: (%s, %s) on %s", CmdSt,
+            inetFmt( source, s1 ), inetFmt( mcastaddr, s2 ), IfDp->Name );
+    }
+
+    if( setsockopt( UdpSock, IPPROTO_IP,
+          Cmd == 'j' ? IP_ADD_SOURCE_MEMBERSHIP : IP_DROP_SOURCE_MEMBERSHIP,
+          (void *)&CtlReq, sizeof( CtlReq ) ) )
+    {
+        my_log( LOG_WARNING, errno, "IP_%s_SOURCE_MEMBERSHIP failed", Cmd == 'j' ? "ADD" : "DROP" );
+        return 1;
+    }
+
+    return 0;
+}
+
 /**
 *   Joins the MC group with the address 'McAdr' on the interface 'IfName'.
 *   The join is bound to the UDP socket 'UdpSock', so if this socket is
@@ -85,3 +113,23 @@ int joinMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr ) {
 int leaveMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr ) {
     return joinleave( 'l', UdpSock, IfDp, mcastaddr );
 }
+
+/**
+*   Joins a single source of the MC group with the address 'mcastaddr'
+*   on the interface 'IfDp'.
+*
+*   @return 0 if the function succeeds, 1 if parameters are wrong or the join fails
+*/
+int joinMcSourceGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr, uint32_t source ) {
+    return joinleaveSource( 'j', UdpSock, IfDp, mcastaddr, source );
+}
+
+/**
+*   Leaves a single source of the MC group with the address 'mcastaddr'
+*   on the interface 'IfDp'.
+*
+*   @return 0 if the function succeeds, 1 if parameters are wrong or the leave fails
+*/
+int leaveMcSourceGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr, uint32_t source ) {
+    return joinleaveSource( 'l', UdpSock, IfDp, mcastaddr, source );
+}
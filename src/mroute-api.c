@@ -239,6 +239,28 @@ int delMRoute( struct MRouteDesc *Dp )
     return rc;
 }
 
+/*
+** Reads the number of bytes the kernel has forwarded on the
+** multicast route '*Dp' into '*bytes'
+**
+** returns: - 0 if the function succeeds
+**          - the errno value for non-fatal failure condition
+*/
+int getMRouteBytes( struct MRouteDesc *Dp, unsigned long *bytes )
+{
+    struct sioc_sg_req SgReq;
+
+    memset( &SgReq, 0, sizeof( SgReq ) );
+    SgReq.src = Dp->OriginAdr;
+    SgReq.grp = Dp->McAdr;
+
+    if ( ioctl( MRouterFD, SIOCGETSGCNT, &SgReq ) < 0 )
+        return errno;
+
+    *bytes = SgReq.bytecnt;
+    return 0;
+}
+
 /*
 ** Returns for the virtual interface index for '*IfDp'
 **
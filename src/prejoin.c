@@ -0,0 +1,331 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   prejoin.c
+*
+*   Keeps the most popular groups joined upstream, so the first
+*   listener after an idle period only needs a local route update.
+*   Popularity is the number of times a group got a new downstream
+*   listener, halved every POPULARITY_HALFLIFE seconds. The most
+*   popular groups are pre-joined, within the configured count and
+*   bandwidth budget. The counters are saved to a file, so they
+*   survive restarts.
+*/
+
+#include "igmpproxy.h"
+
+#define POPULARITY_HALFLIFE     3600    // Seconds for a score to halve
+#define POPULARITY_SCALE        256     // Score of a single join
+#define PREJOIN_REFRESH         60      // Seconds between refreshes
+#define MAX_TRACKED_GROUPS      1024
+
+/**
+*   The popularity of a group.
+*/
+struct GroupPopularity {
+    struct GroupPopularity  *next;
+    uint32_t                group;
+    unsigned long           score;      // Decayed joins, in 1/POPULARITY_SCALE
+    long                    period;     // Half-life period the score was last decayed in
+    unsigned long           rate;       // Measured bytes per second, 0 if not known
+    unsigned long           bytes;      // Forwarded byte count at the last measurement
+    time_t                  measured;   // Time of the last measurement, 0 if none
+    short                   live;       // Rate measured by this run, not loaded
+    short                   joined;     // Pre-joined upstream
+    short                   pick;       // Refresh decision: 1 chosen, -1 over budget
+};
+
+static struct GroupPopularity  *popularity;
+static int                     trackedGroups;
+
+/**
+*   Returns the current half-life period. Wall clock time is used,
+*   so saved scores decay over the time the daemon was down.
+*/
+static long currentPeriod(void) {
+    return time(NULL) / POPULARITY_HALFLIFE;
+}
+
+/**
+*   Brings the score of a group up to the current period.
+*/
+static void decayScore(struct GroupPopularity *gp, long period) {
+    long halvings = period - gp->period;
+
+    if(halvings > 0) {
+        gp->score = halvings >= (long)(sizeof(gp->score) * 8) ? 0 : gp->score >> halvings;
+        gp->period = period;
+    }
+}
+
+/**
+*   Finds the popularity entry of a group. If 'create' is set, a
+*   missing entry is created, evicting the least popular group that
+*   is not pre-joined when the table is full.
+*/
+static struct GroupPopularity *findPopularity(uint32_t group, int create) {
+    struct GroupPopularity *gp, **gpp, **victim = NULL;
+    long period = currentPeriod();
+
+    for(gpp = &popularity; (gp = *gpp) != NULL; gpp = &gp->next) {
+        if(gp->group == group) {
+            return gp;
+        }
+        decayScore(gp, period);
+        if(!gp->joined && (victim == NULL || gp->score < (*victim)->score)) {
+            victim = gpp;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+
+    if(trackedGroups >= MAX_TRACKED_GROUPS) {
+        if(victim == NULL) {
+            return NULL;
+        }
+        gp = *victim;
+        *victim = gp->next;
+        free(gp);
+        trackedGroups--;
+    }
+
+    gp = (struct GroupPopularity*) malloc(sizeof(struct GroupPopularity));
+    if(gp == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    memset(gp, 0, sizeof(struct GroupPopularity));
+    gp->group  = group;
+    gp->period = period;
+    gp->next   = popularity;
+    popularity = gp;
+    trackedGroups++;
+
+    return gp;
+}
+
+/**
+*   Records that a group got a new downstream listener.
+*/
+void notePopularity(uint32_t group) {
+    struct Config           *conf = getCommonConfig();
+    struct GroupPopularity  *gp;
+
+    if(conf->prejoinCount == 0) {
+        return;
+    }
+
+    gp = findPopularity(group, 1);
+    if(gp != NULL) {
+        decayScore(gp, currentPeriod());
+        gp->score += POPULARITY_SCALE;
+    }
+}
+
+/**
+*   Updates the measured bandwidth of a group from the kernel
+*   forwarding counters.
+*/
+static void measureRate(struct GroupPopularity *gp, time_t now) {
+    unsigned long bytes;
+
+    if(!getRouteBytes(gp->group, &bytes)) {
+        gp->measured = 0;
+        return;
+    }
+    if(gp->measured && now > gp->measured && bytes >= gp->bytes) {
+        gp->rate = (bytes - gp->bytes) / (now - gp->measured);
+        gp->live = 1;
+    }
+    gp->bytes    = bytes;
+    gp->measured = now;
+}
+
+/**
+*   Returns the bandwidth a group is charged against the budget, in
+*   bytes per second: the rate measured by this run, else the bitrate
+*   stanza of the group, else the rate saved by an earlier run.
+*   Returns 0 if nothing is known about the group.
+*/
+static unsigned long chargedRate(struct GroupPopularity *gp) {
+    unsigned long bitrate;
+    int           priority;
+
+    if(gp->live) {
+        return gp->rate;
+    }
+    bitrate = getGroupBitrate(gp->group, &priority);
+    if(bitrate > 0) {
+        return bitrate * 1000 / 8;
+    }
+    return gp->rate;
+}
+
+/**
+*   Writes the popularity table to the configured file.
+*/
+void savePreJoin(void) {
+    struct Config           *conf = getCommonConfig();
+    struct GroupPopularity  *gp;
+    FILE                    *fp;
+
+    if(conf->prejoinCount == 0 || conf->prejoinFile == NULL) {
+        return;
+    }
+
+    fp = fopen(conf->prejoinFile, "w");
+    if(fp == NULL) {
+        my_log(LOG_WARNING, errno, "Unable to save group popularity to %s", conf->prejoinFile);
+        return;
+    }
+    for(gp = popularity; gp != NULL; gp = gp->next) {
+        if(gp->score > 0) {
+            fprintf(fp, "%s %ld %lu %lu\n", inetFmt(gp->group, s1),
+                gp->period, gp->score, gp->rate);
+        }
+    }
+    fclose(fp);
+}
+
+/**
+*   Reads the popularity table saved by an earlier run.
+*/
+static void loadPreJoin(void) {
+    struct Config           *conf = getCommonConfig();
+    struct GroupPopularity  *gp;
+    char                    addr[16];
+    long                    period;
+    unsigned long           score, rate;
+    uint32_t                group;
+    FILE                    *fp;
+
+    if(conf->prejoinFile == NULL) {
+        return;
+    }
+
+    fp = fopen(conf->prejoinFile, "r");
+    if(fp == NULL) {
+        my_log(LOG_DEBUG, errno, "No saved group popularity in %s", conf->prejoinFile);
+        return;
+    }
+    while(fscanf(fp, "%15s %ld %lu %lu", addr, &period, &score, &rate) == 4) {
+        group = inet_addr(addr);
+        if(!IN_MULTICAST(ntohl(group))) {
+            continue;
+        }
+        gp = findPopularity(group, 1);
+        if(gp != NULL) {
+            gp->period = period;
+            gp->score  = score;
+            gp->rate   = rate;
+        }
+    }
+    fclose(fp);
+
+    my_log(LOG_DEBUG, 0, "Loaded popularity of %d groups from %s", trackedGroups, conf->prejoinFile);
+}
+
+/**
+*   Pre-joins the most popular groups, within the configured count
+*   and bandwidth budget, and drops the pre-joins of groups that
+*   fell out. With a budget, groups of unknown bandwidth wait until
+*   they have been measured. Runs every PREJOIN_REFRESH seconds.
+*/
+static void refreshPreJoins(void *arg) {
+    struct Config           *conf = getCommonConfig();
+    struct GroupPopularity  *gp, *best, **gpp;
+    unsigned long           budget, rate, used = 0;
+    long                    period = currentPeriod();
+    time_t                  now = monotonicTime();
+    unsigned                chosen = 0;
+
+    (void)arg;
+
+    // Budget is configured in kbit/s, rates are measured in bytes per second.
+    budget = conf->prejoinBudget * 1000 / 8;
+
+    for(gp = popularity; gp != NULL; gp = gp->next) {
+        decayScore(gp, period);
+        measureRate(gp, now);
+    }
+
+    // Pick the most popular groups that fit, one by one...
+    for(gp = popularity; gp != NULL; gp = gp->next) {
+        gp->pick = 0;
+    }
+    while(chosen < conf->prejoinCount) {
+        for(best = NULL, gp = popularity; gp != NULL; gp = gp->next) {
+            if(gp->pick == 0 && gp->score >= POPULARITY_SCALE &&
+               (best == NULL || gp->score > best->score)) {
+                best = gp;
+            }
+        }
+        if(best == NULL) {
+            break;
+        }
+        rate = chargedRate(best);
+        if(budget > 0 && ((rate == 0 && !best->live) || used + rate > budget)) {
+            best->pick = -1;
+            continue;
+        }
+        used += rate;
+        best->pick = 1;
+        chosen++;
+    }
+
+    // ...and apply the changes.
+    for(gpp = &popularity; (gp = *gpp) != NULL; ) {
+        if(gp->joined && gp->pick != 1) {
+            my_log(LOG_DEBUG, 0, "Dropping pre-join of %s", inetFmt(gp->group, s1));
+            setRoutePreJoin(gp->group, 0);
+        } else if(!gp->joined && gp->pick == 1) {
+            my_log(LOG_DEBUG, 0, "Pre-joining popular group %s", inetFmt(gp->group, s1));
+            setRoutePreJoin(gp->group, 1);
+        }
+        gp->joined = gp->pick == 1;
+
+        // Forget groups that are no longer popular at all.
+        if(gp->score == 0 && !gp->joined) {
+            *gpp = gp->next;
+            free(gp);
+            trackedGroups--;
+            continue;
+        }
+        gpp = &gp->next;
+    }
+
+    savePreJoin();
+
+    timer_setTimer(PREJOIN_REFRESH, refreshPreJoins, NULL);
+}
+
+/**
+*   Loads the saved popularity, and starts pre-joining.
+*/
+void initPreJoin(void) {
+    struct Config *conf = getCommonConfig();
+
+    if(conf->prejoinCount == 0) {
+        return;
+    }
+
+    loadPreJoin();
+    timer_setTimer(1, refreshPreJoins, NULL);
+}
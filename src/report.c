@@ -0,0 +1,422 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   report.c
+*
+*   Sends the proxy's own IGMPv3 membership reports on the upstream
+*   interfaces, instead of leaving that to the kernel. Many group
+*   records are packed into each report. Membership changes are
+*   reported at once and retransmitted, and queries from upstream
+*   routers are answered with jittered current state reports.
+*/
+
+#include "igmpproxy.h"
+#include "igmpv3.h"
+
+#define REPORT_HASH_SIZE            256
+#define UNSOLICITED_REPORT_INTERVAL 1
+
+/**
+*   Membership of a group on one upstream interface.
+*/
+struct UpstreamGroup {
+    struct UpstreamGroup *next;
+    struct IfDesc       *upstrIf;
+    uint32_t            group;
+    short               joined;         // Current membership.
+    int                 nsources;       // Source specific membership, 0 for any source.
+    uint32_t            sources[MAX_ORIGINS];
+    short               retransmit;     // State change reports left to send.
+    time_t              changeDue;      // Next state change report, or 0.
+    time_t              responseDue;    // Group specific query response, or 0.
+};
+
+/**
+*   Report state of one upstream interface.
+*/
+struct UpstreamReporter {
+    struct IfDesc       *upstrIf;
+    unsigned            mtu;
+    int                 olderVersion;   // Version of an older querier present, or 0.
+    time_t              olderUntil;     // Older version querier present timeout.
+    time_t              generalDue;     // General query response, or 0.
+};
+
+static struct UpstreamGroup    *reportTable[REPORT_HASH_SIZE];
+static struct UpstreamReporter reporters[MAX_UPS_VIFS];
+
+// Timer for the next report, and when it runs.
+static int      reportTimer = 0;
+static time_t   reportTime = 0;
+
+// The report being built in the send buffer.
+static struct UpstreamReporter *pktReporter = NULL;
+static int      pktRecords = 0;
+static unsigned pktLen = 0;
+
+// Prototypes
+static void sendPendingReports(void *argument);
+
+static unsigned reportHash(uint32_t group) {
+    return ntohl(group) % REPORT_HASH_SIZE;
+}
+
+/**
+*   Finds the report state of an upstream interface,
+*   setting it up the first time.
+*/
+static struct UpstreamReporter *findReporter(struct IfDesc *upstrIf) {
+    struct UpstreamReporter *rp;
+    struct ifreq IfReq;
+
+    for(rp = reporters; rp < VCEP(reporters); rp++) {
+        if(rp->upstrIf == upstrIf) {
+            return rp;
+        }
+    }
+    for(rp = reporters; rp < VCEP(reporters); rp++) {
+        if(rp->upstrIf == NULL) {
+            break;
+        }
+    }
+    if(rp == VCEP(reporters)) {
+        my_log(LOG_ERR, 0, "No room for reports on upstream %s.", upstrIf->Name);
+    }
+
+    memset(rp, 0, sizeof(*rp));
+    rp->upstrIf = upstrIf;
+
+    // Fill reports up to the MTU of the interface...
+    rp->mtu = MAX_IP_PACKET_LEN;
+    memset(&IfReq, 0, sizeof(IfReq));
+    memcpy(IfReq.ifr_name, upstrIf->Name, sizeof(IfReq.ifr_name));
+    if(ioctl(MRouterFD, SIOCGIFMTU, &IfReq) < 0) {
+        my_log(LOG_WARNING, errno, "ioctl SIOCGIFMTU for %s", upstrIf->Name);
+    } else if(IfReq.ifr_mtu > MAX_IP_PACKET_LEN) {
+        rp->mtu = IfReq.ifr_mtu < RECV_BUF_SIZE ? IfReq.ifr_mtu : RECV_BUF_SIZE;
+    }
+
+    return rp;
+}
+
+static struct UpstreamGroup *findUpstreamGroup(struct IfDesc *upstrIf, uint32_t group) {
+    struct UpstreamGroup *ug;
+
+    for(ug = reportTable[reportHash(group)]; ug; ug = ug->next) {
+        if(ug->group == group && ug->upstrIf == upstrIf) {
+            return ug;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Makes sure pending reports are sent no later than 'due'.
+*/
+static void scheduleReports(time_t due) {
+    time_t now = monotonicTime();
+
+    if(due == 0 || (reportTimer && reportTime <= due)) {
+        return;
+    }
+    if(reportTimer) {
+        timer_clearTimer(reportTimer);
+    }
+    reportTime  = due;
+    reportTimer = timer_setTimer(due > now ? due - now : 0, sendPendingReports, NULL);
+}
+
+/**
+*   Sends the report in the send buffer.
+*/
+static void flushReport(void) {
+    if(pktRecords == 0) {
+        return;
+    }
+
+    // The reserved word and the record count take the place of the group address.
+    sendIgmp(pktReporter->upstrIf->InAdr.s_addr, alligmp3_group,
+             IGMP_V3_MEMBERSHIP_REPORT, 0, htonl(pktRecords), pktLen);
+
+    pktRecords = 0;
+    pktLen = 0;
+}
+
+/**
+*   Adds a group record to the report being built, sending the
+*   report first if the record doesn't fit. When an older version
+*   querier is present, a single IGMPv1 or v2 message is sent instead.
+*/
+static void addRecord(struct UpstreamReporter *rp, int type, uint32_t group,
+                      int nsrcs, uint32_t *sources) {
+    struct igmpv3_grec *grec;
+    uint32_t src = rp->upstrIf->InAdr.s_addr;
+    unsigned size = sizeof(*grec) + nsrcs * sizeof(struct in_addr);
+    int i;
+
+    if(rp->olderVersion) {
+        flushReport();
+        if(type != IGMPV3_CHANGE_TO_INCLUDE && type != IGMPV3_BLOCK_OLD_SOURCES) {
+            sendIgmp(src, group, rp->olderVersion == 1 ? IGMP_V1_MEMBERSHIP_REPORT
+                                                       : IGMP_V2_MEMBERSHIP_REPORT,
+                     0, group, 0);
+        } else if(rp->olderVersion == 2) {
+            sendIgmp(src, allrouters_group, IGMP_V2_LEAVE_GROUP, 0, group, 0);
+        }
+        return;
+    }
+
+    if(pktRecords > 0 && (pktReporter != rp ||
+       IP_HEADER_RAOPT_LEN + IGMP_MINLEN + pktLen + size > rp->mtu)) {
+        flushReport();
+    }
+
+    pktReporter = rp;
+    grec = (struct igmpv3_grec *)(send_buf + IP_HEADER_RAOPT_LEN + IGMP_MINLEN + pktLen);
+    grec->grec_type     = type;
+    grec->grec_auxwords = 0;
+    grec->grec_nsrcs    = htons(nsrcs);
+    grec->grec_mca.s_addr = group;
+    for(i = 0; i < nsrcs; i++) {
+        grec->grec_src[i].s_addr = sources[i];
+    }
+
+    pktLen += size;
+    pktRecords++;
+}
+
+/**
+*   Adds the state change record of a group: TO_EX({}) or TO_IN({})
+*   for any source membership, ALLOW or BLOCK for source specific
+*   membership.
+*/
+static void addChangeRecord(struct UpstreamReporter *rp, struct UpstreamGroup *ug) {
+    if(ug->nsources > 0) {
+        addRecord(rp, ug->joined ? IGMPV3_ALLOW_NEW_SOURCES : IGMPV3_BLOCK_OLD_SOURCES,
+                  ug->group, ug->nsources, ug->sources);
+    } else {
+        addRecord(rp, ug->joined ? IGMPV3_CHANGE_TO_EXCLUDE : IGMPV3_CHANGE_TO_INCLUDE,
+                  ug->group, 0, NULL);
+    }
+}
+
+/**
+*   Adds the current state record of a joined group: IS_EX({}), or
+*   IS_IN(sources) for source specific membership.
+*/
+static void addStateRecord(struct UpstreamReporter *rp, struct UpstreamGroup *ug) {
+    if(ug->nsources > 0) {
+        addRecord(rp, IGMPV3_MODE_IS_INCLUDE, ug->group, ug->nsources, ug->sources);
+    } else {
+        addRecord(rp, IGMPV3_MODE_IS_EXCLUDE, ug->group, 0, NULL);
+    }
+}
+
+/**
+*   Sends all reports that are due: responses to general and group
+*   specific queries, and state change reports and their
+*   retransmissions. Groups that have been left and fully reported
+*   are forgotten.
+*/
+static void sendPendingReports(void *argument) {
+    struct UpstreamReporter *rp;
+    struct UpstreamGroup **ugp, *ug;
+    time_t now = monotonicTime();
+    time_t next = 0;
+    unsigned bucket;
+    int general;
+
+    (void)argument;
+    reportTimer = 0;
+
+    for(rp = reporters; rp < VCEP(reporters) && rp->upstrIf; rp++) {
+        if(rp->olderVersion && rp->olderUntil <= now) {
+            my_log(LOG_INFO, 0, "No older version querier left on %s. Sending IGMPv3 reports.",
+                rp->upstrIf->Name);
+            rp->olderVersion = 0;
+        }
+
+        general = rp->generalDue && rp->generalDue <= now;
+        if(general) {
+            rp->generalDue = 0;
+        }
+
+        for(bucket = 0; bucket < REPORT_HASH_SIZE; bucket++) {
+            for(ugp = &reportTable[bucket]; (ug = *ugp) != NULL; ) {
+                if(ug->upstrIf != rp->upstrIf) {
+                    ugp = &ug->next;
+                    continue;
+                }
+
+                if(ug->changeDue && ug->changeDue <= now) {
+                    addChangeRecord(rp, ug);
+                    ug->changeDue = --ug->retransmit > 0 ? now + UNSOLICITED_REPORT_INTERVAL : 0;
+                }
+                else if(ug->joined && (general || (ug->responseDue && ug->responseDue <= now))) {
+                    addStateRecord(rp, ug);
+                    ug->responseDue = 0;
+                }
+
+                if(!ug->joined && ug->retransmit <= 0) {
+                    *ugp = ug->next;
+                    free(ug);
+                    continue;
+                }
+
+                if(ug->changeDue && (next == 0 || ug->changeDue < next)) {
+                    next = ug->changeDue;
+                }
+                if(ug->responseDue && (next == 0 || ug->responseDue < next)) {
+                    next = ug->responseDue;
+                }
+                ugp = &ug->next;
+            }
+        }
+        flushReport();
+
+        if(rp->generalDue && (next == 0 || rp->generalDue < next)) {
+            next = rp->generalDue;
+        }
+    }
+
+    scheduleReports(next);
+}
+
+/**
+*   Records that the membership of a group on an upstream interface
+*   changed, and sends a state change report for it. With sources,
+*   the membership is source specific.
+*/
+void reportUpstreamMembership(struct IfDesc *upstrIf, uint32_t group, int join,
+                              int nsrcs, uint32_t *sources) {
+    struct Config *conf = getCommonConfig();
+    struct UpstreamGroup *ug;
+    time_t now = monotonicTime();
+
+    findReporter(upstrIf);
+
+    ug = findUpstreamGroup(upstrIf, group);
+    if(ug == NULL) {
+        if(!join) {
+            return;
+        }
+        ug = (struct UpstreamGroup*)malloc(sizeof(struct UpstreamGroup));
+        if(ug == NULL) {
+            my_log(LOG_ERR, 0, "Out of memory.");
+        }
+        ug->upstrIf = upstrIf;
+        ug->group   = group;
+        ug->joined  = 0;
+        ug->next    = reportTable[reportHash(group)];
+        reportTable[reportHash(group)] = ug;
+    }
+    else if(ug->joined == join) {
+        return;
+    }
+
+    if(join) {
+        ug->nsources = nsrcs < MAX_ORIGINS ? nsrcs : MAX_ORIGINS;
+        memcpy(ug->sources, sources, ug->nsources * sizeof(uint32_t));
+    }
+    ug->joined      = join;
+    ug->retransmit  = conf->robustnessValue;
+    ug->changeDue   = now;
+    ug->responseDue = 0;
+
+    scheduleReports(now);
+}
+
+/**
+*   Handles a query received on an upstream interface. The response
+*   is sent after a random delay within the max response time. Older
+*   version queries switch the interface to older version reports.
+*/
+void acceptUpstreamQuery(struct IfDesc *upstrIf, uint32_t group, int version, unsigned maxresp) {
+    struct Config *conf = getCommonConfig();
+    struct UpstreamReporter *rp;
+    struct UpstreamGroup *ug;
+    time_t now = monotonicTime();
+    time_t due;
+
+    if(!conf->upstreamReports) {
+        return;
+    }
+
+    rp = findReporter(upstrIf);
+
+    if(version < 3) {
+        if(rp->olderVersion == 0 || version < rp->olderVersion) {
+            my_log(LOG_INFO, 0, "IGMPv%d querier present on %s.", version, upstrIf->Name);
+            rp->olderVersion = version;
+        }
+        rp->olderUntil = now + conf->robustnessValue * conf->queryInterval
+                             + conf->queryResponseInterval;
+    }
+
+    due = now + random() % (maxresp / IGMP_TIMER_SCALE + 1);
+
+    if(group == 0) {
+        if(rp->generalDue == 0 || due < rp->generalDue) {
+            rp->generalDue = due;
+        }
+    } else {
+        ug = findUpstreamGroup(upstrIf, group);
+        if(ug == NULL || !ug->joined) {
+            return;
+        }
+        if(ug->responseDue == 0 || due < ug->responseDue) {
+            ug->responseDue = due;
+        }
+    }
+
+    scheduleReports(due);
+}
+
+/**
+*   Sends the state change reports that are still pending right
+*   away, and forgets all upstream membership. Used on shutdown.
+*/
+void flushUpstreamReports(void) {
+    struct UpstreamReporter *rp;
+    struct UpstreamGroup *ug;
+    unsigned bucket;
+
+    for(rp = reporters; rp < VCEP(reporters) && rp->upstrIf; rp++) {
+        for(bucket = 0; bucket < REPORT_HASH_SIZE; bucket++) {
+            for(ug = reportTable[bucket]; ug; ug = ug->next) {
+                if(ug->upstrIf == rp->upstrIf && ug->retransmit > 0) {
+                    addChangeRecord(rp, ug);
+                }
+            }
+        }
+        flushReport();
+    }
+
+    for(bucket = 0; bucket < REPORT_HASH_SIZE; bucket++) {
+        while((ug = reportTable[bucket]) != NULL) {
+            reportTable[bucket] = ug->next;
+            free(ug);
+        }
+    }
+    if(reportTimer) {
+        timer_clearTimer(reportTimer);
+        reportTimer = 0;
+    }
+}
@@ -39,42 +39,459 @@
 */
 
 #include "igmpproxy.h"
+#include "igmpv3.h"
 
 // Prototypes...
 void sendGroupSpecificMemberQuery(void *argument);
 
-typedef struct {
-    uint32_t      group;
-    // uint32_t      vifAddr;
+/**
+*   The last member query cycle of a group on a VIF. There is at
+*   most one cycle per group and VIF; later leaves refresh it.
+*/
+typedef struct GroupVifDesc {
+    struct GroupVifDesc *next;
+    uint32_t    group;
+    int         vif;
+    int         count;          // Queries left
+    int         timerId;        // Pending query round
     short       started;
 } GroupVifDesc;
 
+// Running last member query cycles.
+static GroupVifDesc *lastMemberChecks;
+
+typedef struct {
+    uint32_t    group;
+    int         vif;
+    int         count;          // Transmissions left
+    int         nsrcs;
+    uint32_t    sources[];
+} SourceQueryDesc;
 
 /**
-*   Handles incoming membership reports, and
-*   appends them to the routing table.
+*   Finds the running last member query cycle of a group on a VIF.
+*/
+static GroupVifDesc *findLastMemberCheck(uint32_t group, int vif) {
+    GroupVifDesc *gvDesc;
+
+    for(gvDesc = lastMemberChecks; gvDesc != NULL; gvDesc = gvDesc->next) {
+        if(gvDesc->group == group && gvDesc->vif == vif) {
+            return gvDesc;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Unlinks a last member query cycle from the running cycles.
 */
-void acceptGroupReport(uint32_t src, uint32_t group) {
-    struct IfDesc  *sourceVif;
+static void unlinkLastMemberCheck(GroupVifDesc *gvDesc) {
+    GroupVifDesc **gvp;
+
+    for(gvp = &lastMemberChecks; *gvp != NULL; gvp = &(*gvp)->next) {
+        if(*gvp == gvDesc) {
+            *gvp = gvDesc->next;
+            return;
+        }
+    }
+}
 
+/**
+*   Stops the last member query cycle of a group on a VIF, if one
+*   is running. Called when a member has reported.
+*/
+static void cancelLastMemberCheck(uint32_t group, int vif) {
+    GroupVifDesc *gvDesc;
+
+    gvDesc = findLastMemberCheck(group, vif);
+    if(gvDesc != NULL) {
+        my_log(LOG_DEBUG, 0, "Member of %s reported on VIF #%d. Stopping last member queries.",
+            inetFmt(group, s1), vif);
+        unlinkLastMemberCheck(gvDesc);
+        // Clearing the timer frees the descriptor.
+        timer_clearTimer(gvDesc->timerId);
+    }
+}
+
+#define HOST_HASH_SIZE  1024
+
+/**
+*   A host that has reported membership of a group on a VIF.
+*   Entries are forgotten when the host leaves, or when it has
+*   not reported for a group membership interval. The last report
+*   handled is kept, so repeats of it can be recognized.
+*/
+typedef struct ReporterHost {
+    struct ReporterHost *next;
+    uint32_t    group;
+    uint32_t    host;
+    int         vif;
+    time_t      expires;
+    time_t      reported;       // Time the last report was handled
+    uint32_t    digest;         // Digest of the last report handled
+} ReporterHost;
+
+// Known reporting hosts, hashed on group and VIF.
+static ReporterHost *hostTable[HOST_HASH_SIZE];
+
+// Membership activity since the last general query, for the adaptive query timers.
+static unsigned reportCount;        // Reports and records accepted
+static unsigned churnCount;         // Hosts joining or leaving groups
+static unsigned lostCount;          // Groups whose last host went silent without leaving
+
+/**
+*   The number of groups a host is a known member of on a VIF,
+*   for the host group cap. Entries go away with the last group.
+*/
+typedef struct HostGroups {
+    struct HostGroups *next;
+    uint32_t    host;
+    int         vif;
+    unsigned    groups;
+} HostGroups;
+
+// Group counts of the known hosts, hashed on host and VIF.
+static HostGroups *hostGroupTable[HOST_HASH_SIZE];
+
+// Groups with known members on each VIF, and the joins refused by the caps.
+static unsigned      vifGroups[MAX_MC_VIFS];
+static unsigned long vifCapRejects[MAX_MC_VIFS];
+static unsigned long hostCapRejects[MAX_MC_VIFS];
+
+static unsigned hostHash(uint32_t group, int vif) {
+    return (ntohl(group) * 31 + vif) % HOST_HASH_SIZE;
+}
+
+/**
+*   Finds the group count of a host on a VIF. If 'create' is set,
+*   a missing entry is created with no groups.
+*/
+static HostGroups *findHostGroups(uint32_t host, int vif, int create) {
+    HostGroups *hg;
+    unsigned bucket = hostHash(host, vif);
+
+    for(hg = hostGroupTable[bucket]; hg != NULL; hg = hg->next) {
+        if(hg->host == host && hg->vif == vif) {
+            return hg;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+
+    hg = (HostGroups*) malloc(sizeof(HostGroups));
+    if(hg == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    hg->host   = host;
+    hg->vif    = vif;
+    hg->groups = 0;
+    hg->next   = hostGroupTable[bucket];
+    hostGroupTable[bucket] = hg;
+    return hg;
+}
+
+/**
+*   Takes a group off the count of a host on a VIF.
+*/
+static void releaseHostGroup(uint32_t host, int vif) {
+    HostGroups **hgp, *hg;
+
+    for(hgp = &hostGroupTable[hostHash(host, vif)]; (hg = *hgp) != NULL; hgp = &hg->next) {
+        if(hg->host == host && hg->vif == vif) {
+            if(--hg->groups == 0) {
+                *hgp = hg->next;
+                free(hg);
+            }
+            return;
+        }
+    }
+}
+
+/**
+*   Walks the hosts of a group on a VIF, dropping expired hosts
+*   and the host 'forget' points to, if any, along the way. Returns
+*   the entry for 'host', or NULL, and the number of hosts left in
+*   'count'. Hosts may report from 0.0.0.0, so no address can stand
+*   for nobody.
+*
+*   Hosts that suppress their reports expire all the time, so a
+*   group only counts as lost when its last host expired while the
+*   route still forwarded it to the VIF.
+*/
+static ReporterHost *scanReporters(uint32_t group, int vif, uint32_t host,
+                                   const uint32_t *forget, int *count) {
+    ReporterHost **rhp, *rh, *found = NULL;
+    time_t now = monotonicTime();
+    int removed = 0, expired = 0, forgotten;
+
+    *count = 0;
+    for(rhp = &hostTable[hostHash(group, vif)]; (rh = *rhp) != NULL; ) {
+        if(rh->group == group && rh->vif == vif) {
+            forgotten = forget != NULL && rh->host == *forget;
+            if(rh->expires <= now || forgotten) {
+                if(!forgotten) {
+                    expired++;
+                }
+                *rhp = rh->next;
+                releaseHostGroup(rh->host, vif);
+                free(rh);
+                removed++;
+                continue;
+            }
+            if(rh->host == host) {
+                found = rh;
+            }
+            (*count)++;
+        }
+        rhp = &rh->next;
+    }
+
+    // The group has no known members on the VIF anymore.
+    if(removed > 0 && *count == 0) {
+        vifGroups[vif]--;
+        if(expired > 0 && interfaceInRoute(group, vif)) {
+            lostCount++;
+        }
+    }
+    return found;
+}
+
+/**
+*   Drops the hosts that have not reported for a group membership
+*   interval, so they stop counting against the group caps. The
+*   other walks only see the groups that are still reported.
+*/
+static void expireReporters(void) {
+    ReporterHost *rh;
+    time_t now = monotonicTime();
+    unsigned bucket;
+    int count;
+
+    for(bucket = 0; bucket < HOST_HASH_SIZE; bucket++) {
+        for(rh = hostTable[bucket]; rh != NULL; ) {
+            if(rh->expires <= now) {
+                // The scan changes the bucket, so start it over.
+                scanReporters(rh->group, rh->vif, INADDR_ANY, NULL, &count);
+                rh = hostTable[bucket];
+            } else {
+                rh = rh->next;
+            }
+        }
+    }
+}
+
+/**
+*   Checks the group caps of a downstream interface before 'host'
+*   becomes a member of a group there. Hosts that are members
+*   already are always let through. Returns 0 if the join is refused.
+*/
+static int admitReporter(struct IfDesc *Dp, uint32_t group, uint32_t host) {
+    HostGroups *hg;
+    int count;
+
+    if(Dp->maxGroups == 0 && Dp->hostMaxGroups == 0) {
+        return 1;
+    }
+    if(scanReporters(group, Dp->index, host, NULL, &count) != NULL) {
+        return 1;
+    }
+
+    if(Dp->maxGroups > 0 && count == 0 && vifGroups[Dp->index] >= Dp->maxGroups) {
+        vifCapRejects[Dp->index]++;
+        my_log(LOG_INFO, 0, "Interface %s has %u groups. Refusing %s for %s.",
+            Dp->Name, vifGroups[Dp->index], inetFmt(group, s1), inetFmt(host, s2));
+        return 0;
+    }
+
+    hg = findHostGroups(host, Dp->index, 0);
+    if(Dp->hostMaxGroups > 0 && hg != NULL && hg->groups >= Dp->hostMaxGroups) {
+        hostCapRejects[Dp->index]++;
+        my_log(LOG_INFO, 0, "Host %s on %s has %u groups. Refusing %s.",
+            inetFmt(host, s1), Dp->Name, hg->groups, inetFmt(group, s2));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+*   Logs the group counts and refused joins of the interfaces
+*   with group caps.
+*/
+void logGroupCaps(void) {
+    struct IfDesc *Dp;
+    int Ix;
+
+    for(Ix = 0; (Dp = getIfByIx(Ix)); Ix++) {
+        if(Dp->state != IF_STATE_DOWNSTREAM || (Dp->maxGroups == 0 && Dp->hostMaxGroups == 0)) {
+            continue;
+        }
+        my_log(LOG_NOTICE, 0, "Group caps on %s: %u groups, %lu joins refused by the interface cap, "
+            "%lu by the host cap.", Dp->Name, vifGroups[Dp->index],
+            vifCapRejects[Dp->index], hostCapRejects[Dp->index]);
+    }
+}
+
+/**
+*   Returns the digest of a report: 0 for an IGMPv1 or v2 report,
+*   and a hash of the record type and sources for an IGMPv3 record.
+*/
+static uint32_t reportDigest(int type, int nsrcs, struct in_addr *sources) {
+    uint32_t digest = type;
+    int i;
+
+    for(i = 0; i < nsrcs; i++) {
+        digest = digest * 31 + ntohl(sources[i].s_addr);
+    }
+    return digest;
+}
+
+/**
+*   Checks if 'host' repeats the last report it sent for a group on
+*   a VIF within a query response interval. A repeat only refreshes
+*   the aging of the host and route, and the caller drops it. Reports
+*   that arrive while the group is being checked for members are
+*   never repeats, as they must end the check.
+*/
+static int isRepeatedReport(uint32_t group, int vif, uint32_t host, uint32_t digest) {
+    struct Config *conf = getCommonConfig();
+    ReporterHost *rh;
+    time_t now = monotonicTime();
+    int count;
+
+    rh = scanReporters(group, vif, host, NULL, &count);
+    if(rh == NULL || rh->digest != digest || now - rh->reported >= (time_t)conf->queryResponseInterval ||
+       findLastMemberCheck(group, vif) != NULL || !refreshRouteAge(group, vif)) {
+        return 0;
+    }
+
+    reportCount++;
+    rh->expires = now + conf->robustnessValue * conf->queryInterval
+                      + conf->queryResponseInterval;
+    return 1;
+}
+
+/**
+*   Makes the next report of every host for a group on a VIF count
+*   in full. Called when the filter timers of the group are lowered,
+*   so the answers to the queries refresh them.
+*/
+static void forgetRepeats(uint32_t group, int vif) {
+    ReporterHost *rh;
+
+    for(rh = hostTable[hostHash(group, vif)]; rh != NULL; rh = rh->next) {
+        if(rh->group == group && rh->vif == vif) {
+            rh->reported = 0;
+        }
+    }
+}
+
+/**
+*   Records that 'host' reported membership of a group on a VIF.
+*/
+static void trackReporter(uint32_t group, int vif, uint32_t host, uint32_t digest) {
+    struct Config *conf = getCommonConfig();
+    ReporterHost *rh;
+    int count;
+
+    rh = scanReporters(group, vif, host, NULL, &count);
+    if(rh == NULL) {
+        rh = (ReporterHost*) malloc(sizeof(ReporterHost));
+        if(rh == NULL) {
+            my_log(LOG_ERR, 0, "Out of memory.");
+        }
+        rh->group = group;
+        rh->host  = host;
+        rh->vif   = vif;
+        rh->next  = hostTable[hostHash(group, vif)];
+        hostTable[hostHash(group, vif)] = rh;
+        churnCount++;
+
+        // Count the membership for the group caps.
+        if(count == 0) {
+            vifGroups[vif]++;
+        }
+        findHostGroups(host, vif, 1)->groups++;
+    }
+    reportCount++;
+    rh->reported = monotonicTime();
+    rh->digest   = digest;
+    rh->expires  = rh->reported + conf->robustnessValue * conf->queryInterval
+                                + conf->queryResponseInterval;
+}
+
+/**
+*   Forgets 'host' as a member of a group on a VIF. Returns the
+*   number of other known hosts that are still members.
+*/
+static int untrackReporter(uint32_t group, int vif, uint32_t host) {
+    int count;
+
+    churnCount++;
+    scanReporters(group, vif, INADDR_ANY, &host, &count);
+    return count;
+}
+
+
+/**
+*   Drops a group from a downstream VIF, along with the hosts known
+*   as its members there, so they stop counting against the group
+*   caps. Called when the group is refused or pre-empted for lack of
+*   bandwidth on the VIF.
+*/
+void forgetGroupOnVif(uint32_t group, int vif) {
+    ReporterHost **rhp, *rh;
+    GroupVifDesc *gvDesc;
+    int removed = 0;
+
+    for(rhp = &hostTable[hostHash(group, vif)]; (rh = *rhp) != NULL; ) {
+        if(rh->group == group && rh->vif == vif) {
+            *rhp = rh->next;
+            releaseHostGroup(rh->host, vif);
+            free(rh);
+            removed++;
+            continue;
+        }
+        rhp = &rh->next;
+    }
+    if(removed > 0) {
+        vifGroups[vif]--;
+    }
+
+    // A running last member check has nothing left to check.
+    gvDesc = findLastMemberCheck(group, vif);
+    if(gvDesc != NULL) {
+        unlinkLastMemberCheck(gvDesc);
+        timer_clearTimer(gvDesc->timerId);
+    }
+
+    clearSourceFilter(group, vif);
+    removeRouteVif(group, vif);
+}
+
+/**
+*   Checks that a membership report from 'src' was received on a
+*   downstream interface, and that the group may be requested
+*   there. Returns NULL if the report should be ignored.
+*/
+static struct IfDesc *getReportVif(struct IfDesc *sourceVif, uint32_t src, uint32_t group) {
     // Sanitycheck the group adress...
     if(!IN_MULTICAST( ntohl(group) )) {
         my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group.",
             inetFmt(group, s1));
-        return;
+        return NULL;
     }
 
-    // Find the interface on which the report was received.
-    sourceVif = getIfByAddress( src );
+    // The report must have come in on a known interface.
     if(sourceVif == NULL) {
         my_log(LOG_WARNING, 0, "No interfaces found for source %s",
             inetFmt(src,s1));
-        return;
+        return NULL;
     }
 
     if(sourceVif->InAdr.s_addr == src) {
         my_log(LOG_NOTICE, 0, "The IGMP message was from myself. Ignoring.");
-        return;
+        return NULL;
     }
 
     // We have a IF so check that it's an downstream IF.
@@ -83,20 +500,10 @@ void acceptGroupReport(uint32_t src, uint32_t group) {
         my_log(LOG_DEBUG, 0, "Should insert group %s (from: %s) to route table. Vif Ix : %d",
             inetFmt(group,s1), inetFmt(src,s2), sourceVif->index);
 
-        // If we don't have a whitelist we insertRoute and done
-        if(sourceVif->allowedgroups == NULL)
-        {
-            insertRoute(group, sourceVif->index);
-            return;
-        }
         // Check if this Request is legit on this interface
-        struct SubnetList *sn;
-        for(sn = sourceVif->allowedgroups; sn != NULL; sn = sn->next)
-            if((group & sn->subnet_mask) == sn->subnet_addr)
-            {
-                // The membership report was OK... Insert it into the route table..
-                insertRoute(group, sourceVif->index);
-                return;
+        if(isGroupAllowedForIf(sourceVif, group)) {
+            // The membership report was OK...
+            return sourceVif;
         }
     my_log(LOG_INFO, 0, "The group address %s may not be requested from this interface. Ignoring.", inetFmt(group, s1));
     } else {
@@ -104,13 +511,100 @@ void acceptGroupReport(uint32_t src, uint32_t group) {
         my_log(LOG_INFO, 0, "Mebership report was received on %s. Ignoring.",
             sourceVif->state==IF_STATE_UPSTREAM?"the upstream interface":"a disabled interface");
     }
+    return NULL;
+}
+
+/**
+*   Handles incoming IGMPv1 and v2 membership reports, and
+*   appends them to the routing table.
+*/
+void acceptGroupReport(struct IfDesc *sourceVif, uint32_t src, uint32_t group) {
+    struct in_addr mapped[MAX_ORIGINS];
+    uint32_t       sources[MAX_ORIGINS];
+    int            nsrcs, i;
+
+    sourceVif = getReportVif(sourceVif, src, group);
+    if(sourceVif == NULL || isRepeatedReport(group, sourceVif->index, src, 0) ||
+       !admitReporter(sourceVif, group, src)) {
+        return;
+    }
+
+    trackReporter(group, sourceVif->index, src, 0);
+    cancelLastMemberCheck(group, sourceVif->index);
+
+    nsrcs = getSsmSources(group, sources);
+    if(nsrcs > 0) {
+        // With an SSM mapping the report is an IS_IN(mapped sources) record...
+        for(i = 0; i < nsrcs; i++) {
+            mapped[i].s_addr = sources[i];
+        }
+        updateSourceFilter(group, sourceVif->index, IGMPV3_MODE_IS_INCLUDE, nsrcs, mapped);
+    } else {
+        // ...otherwise an older version report is an IS_EX({}) record (RFC 3376 7.3.2)...
+        updateSourceFilter(group, sourceVif->index, IGMPV3_MODE_IS_EXCLUDE, 0, NULL);
+    }
+
+    // The membership report was OK... Insert it into the route table,
+    // unless the interface has no bandwidth left for the group...
+    if(!insertRoute(group, sourceVif->index) && !interfaceInRoute(group, sourceVif->index)) {
+        forgetGroupOnVif(group, sourceVif->index);
+        return;
+    }
+
+    // ...and have the routes for the mapped sources ready before their traffic.
+    if(nsrcs > 0) {
+        preinstallRoute(group, nsrcs, sources);
+    }
+}
+
+/**
+*   Handles a group record from an IGMPv3 membership report.
+*   The sources are kept in the source filter table, and the group
+*   is appended to the routing table as long as the interface wants
+*   any source of it.
+*/
+void acceptGroupRecord(struct IfDesc *sourceVif, uint32_t src, uint32_t group, int type,
+                       int nsrcs, struct in_addr *sources) {
+    uint32_t digest;
+
+    // An empty include record is a leave...
+    if(nsrcs == 0 && (type == IGMPV3_MODE_IS_INCLUDE || type == IGMPV3_CHANGE_TO_INCLUDE)) {
+        acceptLeaveMessage(sourceVif, src, group);
+        return;
+    }
+
+    sourceVif = getReportVif(sourceVif, src, group);
+    if(sourceVif == NULL) {
+        return;
+    }
+
+    // A retransmitted record changes nothing...
+    digest = reportDigest(type, nsrcs, sources);
+    if(type != IGMPV3_BLOCK_OLD_SOURCES && isRepeatedReport(group, sourceVif->index, src, digest)) {
+        return;
+    }
+
+    // ...new memberships must fit in the group caps...
+    if(type != IGMPV3_BLOCK_OLD_SOURCES && !admitReporter(sourceVif, group, src)) {
+        return;
+    }
+
+    // ...and blocking sources only starts source specific queries.
+    if(updateSourceFilter(group, sourceVif->index, type, nsrcs, sources) &&
+       type != IGMPV3_BLOCK_OLD_SOURCES) {
+        trackReporter(group, sourceVif->index, src, digest);
+        cancelLastMemberCheck(group, sourceVif->index);
+        if(!insertRoute(group, sourceVif->index) && !interfaceInRoute(group, sourceVif->index)) {
+            forgetGroupOnVif(group, sourceVif->index);
+        }
+    }
 }
 
 /**
 *   Recieves and handles a group leave message.
 */
-void acceptLeaveMessage(uint32_t src, uint32_t group) {
-    struct IfDesc   *sourceVif;
+void acceptLeaveMessage(struct IfDesc *sourceVif, uint32_t src, uint32_t group) {
+    struct Config   *conf = getCommonConfig();
 
     my_log(LOG_DEBUG, 0,
         "Got leave message from %s to %s. Starting last member detection.",
@@ -123,8 +617,7 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
         return;
     }
 
-    // Find the interface on which the report was received.
-    sourceVif = getIfByAddress( src );
+    // The leave must have come in on a known interface.
     if(sourceVif == NULL) {
         my_log(LOG_WARNING, 0, "No interfaces found for source %s",
             inetFmt(src,s1));
@@ -135,15 +628,51 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
     if(sourceVif->state == IF_STATE_DOWNSTREAM) {
 
         GroupVifDesc   *gvDesc;
+
+        // If other hosts are known to be members, the group stays...
+        if(untrackReporter(group, sourceVif->index, src) > 0) {
+            my_log(LOG_DEBUG, 0, "Other hosts on %s are still members of %s. Not querying.",
+                sourceVif->Name, inetFmt(group, s1));
+            return;
+        }
+
+        // ...and unless hosts suppress their reports, the last one leaving removes it.
+        if(sourceVif->fastleave) {
+            my_log(LOG_DEBUG, 0, "Last known member of %s on %s left. Removing it now.",
+                inetFmt(group, s1), sourceVif->Name);
+            clearSourceFilter(group, sourceVif->index);
+            removeRouteVif(group, sourceVif->index);
+            return;
+        }
+
+        // A leave is a TO_IN({}) record (RFC 3376 7.3.2)...
+        updateSourceFilter(group, sourceVif->index, IGMPV3_CHANGE_TO_INCLUDE, 0, NULL);
+
+        // A cycle already querying the group on this VIF is refreshed, not duplicated.
+        gvDesc = findLastMemberCheck(group, sourceVif->index);
+        if(gvDesc != NULL) {
+            my_log(LOG_DEBUG, 0, "Last member check of %s on %s already running.",
+                inetFmt(group, s1), sourceVif->Name);
+            gvDesc->count = conf->lastMemberQueryCount;
+            return;
+        }
+
         gvDesc = (GroupVifDesc*) malloc(sizeof(GroupVifDesc));
+        if(gvDesc == NULL) {
+            my_log(LOG_ERR, 0, "Out of memory.");
+        }
 
         // Tell the route table that we are checking for remaining members...
-        setRouteLastMemberMode(group);
+        setRouteLastMemberMode(group, sourceVif->index);
 
         // Call the group spesific membership querier...
         gvDesc->group = group;
-        // gvDesc->vifAddr = sourceVif->InAdr.s_addr;
+        gvDesc->vif = sourceVif->index;
+        gvDesc->count = conf->lastMemberQueryCount;
+        gvDesc->timerId = 0;
         gvDesc->started = 0;
+        gvDesc->next = lastMemberChecks;
+        lastMemberChecks = gvDesc;
 
         sendGroupSpecificMemberQuery(gvDesc);
 
@@ -154,86 +683,371 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
 }
 
 /**
-*   Sends a group specific member report query until the
-*   group times out...
+*   Returns true if we are the querier on a downstream VIF, i.e.
+*   no router with a lower address has queried within the other
+*   querier present interval (RFC 3376 6.6.2).
+*/
+static int isQuerier(struct IfDesc *Dp) {
+    if(Dp->querier != 0 && Dp->querierExpires <= monotonicTime()) {
+        my_log(LOG_NOTICE, 0, "Querier %s on %s timed out. Taking over as querier.",
+            inetFmt(Dp->querier, s1), Dp->Name);
+        Dp->querier = 0;
+    }
+    return Dp->querier == 0;
+}
+
+/**
+*   Handles a membership query from another router. Queries from
+*   upstream routers are answered by the upstream report engine.
+*   On downstream VIFs, the router with the lowest address is
+*   elected as querier.
+*/
+void acceptMembershipQuery(struct IfDesc *sourceVif, uint32_t src, uint32_t group,
+                           int version, unsigned maxresp) {
+    struct Config   *conf = getCommonConfig();
+
+    if(sourceVif == NULL || sourceVif->InAdr.s_addr == src) {
+        return;
+    }
+
+    if(sourceVif->state == IF_STATE_UPSTREAM) {
+        noteUpstreamQuery(sourceVif);
+        acceptUpstreamQuery(sourceVif, group, version, maxresp);
+    }
+    else if(sourceVif->state == IF_STATE_DOWNSTREAM) {
+        // Queries without a source address take no part in the election.
+        if(src == 0 || ntohl(src) >= ntohl(sourceVif->InAdr.s_addr)) {
+            return;
+        }
+        if(sourceVif->querier != src) {
+            my_log(LOG_NOTICE, 0, "Querier %s on %s has a lower address. Suspending queries.",
+                inetFmt(src, s1), sourceVif->Name);
+        }
+        sourceVif->querier = src;
+        sourceVif->querierExpires = monotonicTime()
+            + conf->robustnessValue * conf->queryInterval + conf->queryResponseInterval / 2;
+    }
+}
+
+/**
+*   Sends a group specific member report query on the VIF the
+*   leave came in on, until the group times out on that VIF...
 */
 void sendGroupSpecificMemberQuery(void *argument) {
     struct  Config  *conf = getCommonConfig();
     struct  IfDesc  *Dp;
-    int     Ix;
 
     // Cast argument to correct type...
     GroupVifDesc   *gvDesc = (GroupVifDesc*) argument;
 
     if(gvDesc->started) {
         // If aging returns false, we don't do any further action...
-        if(!lastMemberGroupAge(gvDesc->group)) {
-            // FIXME: Should we free gvDesc here?
+        if(!lastMemberGroupAge(gvDesc->group, gvDesc->vif, gvDesc->count <= 0)) {
+            unlinkLastMemberCheck(gvDesc);
+            free(gvDesc);
             return;
         }
     } else {
         gvDesc->started = 1;
     }
 
-    /**
-     * FIXME: This loops through all interfaces the group is active on an sends queries.
-     *        It might be better to send only a query on the interface the leave was accepted on and remove only that interface from the route.
-     */
+    Dp = getIfByVifIndex(gvDesc->vif);
+    if(Dp == NULL || Dp->state != IF_STATE_DOWNSTREAM || !interfaceInRoute(gvDesc->group, gvDesc->vif)) {
+        unlinkLastMemberCheck(gvDesc);
+        free(gvDesc);
+        return;
+    }
 
-    // Loop through all downstream interfaces
-    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-        if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) ) {
-            if(Dp->state == IF_STATE_DOWNSTREAM) {
-                // Is that interface used in the group?
-                if (interfaceInRoute(gvDesc->group ,Dp->index)) {
+    // Send a group specific membership query, unless the querier does...
+    if(isQuerier(Dp)) {
+        sendIgmpV3Query(Dp->InAdr.s_addr, gvDesc->group, gvDesc->group,
+                conf->lastMemberQueryInterval * IGMP_TIMER_SCALE,
+                0, 0, NULL);
 
-                    // Send a group specific membership query...
-                    sendIgmp(Dp->InAdr.s_addr, gvDesc->group,
-                            IGMP_MEMBERSHIP_QUERY,
-                            conf->lastMemberQueryInterval * IGMP_TIMER_SCALE,
-                            gvDesc->group, 0);
+        my_log(LOG_DEBUG, 0, "Sent membership query from %s to %s. Delay: %d",
+                inetFmt(Dp->InAdr.s_addr,s1), inetFmt(gvDesc->group,s2),
+                conf->lastMemberQueryInterval);
+    }
+    gvDesc->count--;
 
-                    my_log(LOG_DEBUG, 0, "Sent membership query from %s to %s. Delay: %d",
-                            inetFmt(Dp->InAdr.s_addr,s1), inetFmt(gvDesc->group,s2),
-                            conf->lastMemberQueryInterval);
-                }
+    // Set timeout for next round...
+    gvDesc->timerId = timer_setTimer(conf->lastMemberQueryInterval, sendGroupSpecificMemberQuery, gvDesc);
+}
+
+
+/**
+*   Sends a group-and-source specific query round, and schedules
+*   the next retransmission. Sources whose timer was refreshed by a
+*   report since the first round are queried with the S flag set,
+*   and sources that went away are no longer queried.
+*/
+static void sendSourceQueryRound(void *argument) {
+    struct  Config  *conf = getCommonConfig();
+    struct  IfDesc  *Dp;
+    uint32_t        suppressed[IGMPV3_MAX_QUERY_SRCS], plain[IGMPV3_MAX_QUERY_SRCS];
+    int             nsuppressed = 0, nplain = 0, i, r;
+
+    // Cast argument to correct type...
+    SourceQueryDesc *sqDesc = (SourceQueryDesc*) argument;
+
+    Dp = getIfByVifIndex(sqDesc->vif);
+    if(Dp == NULL || Dp->state != IF_STATE_DOWNSTREAM) {
+        free(sqDesc);
+        return;
+    }
+
+    if(sqDesc->nsrcs == 0) {
+        r = sourceFilterSuppress(sqDesc->group, sqDesc->vif, 0);
+        if(r >= 0) {
+            sendIgmpV3Query(Dp->InAdr.s_addr, sqDesc->group, sqDesc->group,
+                            conf->lastMemberQueryInterval * IGMP_TIMER_SCALE, r, 0, NULL);
+            nplain++;
+        }
+    } else {
+        for(i = 0; i < sqDesc->nsrcs; i++) {
+            r = sourceFilterSuppress(sqDesc->group, sqDesc->vif, sqDesc->sources[i]);
+            if(r > 0) {
+                suppressed[nsuppressed++] = sqDesc->sources[i];
+            } else if(r == 0) {
+                plain[nplain++] = sqDesc->sources[i];
             }
         }
+        if(nsuppressed > 0) {
+            sendIgmpV3Query(Dp->InAdr.s_addr, sqDesc->group, sqDesc->group,
+                            conf->lastMemberQueryInterval * IGMP_TIMER_SCALE, 1,
+                            nsuppressed, suppressed);
+        }
+        if(nplain > 0) {
+            sendIgmpV3Query(Dp->InAdr.s_addr, sqDesc->group, sqDesc->group,
+                            conf->lastMemberQueryInterval * IGMP_TIMER_SCALE, 0,
+                            nplain, plain);
+        }
     }
 
-    // Set timeout for next round...
-    timer_setTimer(conf->lastMemberQueryInterval, sendGroupSpecificMemberQuery, gvDesc);
+    my_log(LOG_DEBUG, 0, "Sent query for %d sources of %s from %s. Delay: %d",
+            nsuppressed + nplain, inetFmt(sqDesc->group,s1), inetFmt(Dp->InAdr.s_addr,s2),
+            conf->lastMemberQueryInterval);
+
+    // Set timeout for next round, as long as there is anything left to query...
+    if(--sqDesc->count > 0 && nsuppressed + nplain > 0) {
+        timer_setTimer(conf->lastMemberQueryInterval, sendSourceQueryRound, sqDesc);
+    } else {
+        free(sqDesc);
+    }
+}
+
+/**
+*   Asks the hosts on a downstream VIF if any of them still want
+*   the given sources of a group. With no sources the whole group
+*   is queried. The query is sent lastMemberQueryCount times.
+*/
+void sendGroupSourceQuery(uint32_t group, int vif, int nsrcs, uint32_t *sources) {
+    struct  Config  *conf = getCommonConfig();
+    struct  IfDesc  *Dp;
+    SourceQueryDesc *sqDesc;
+
+    // The answers must not be taken for repeats.
+    forgetRepeats(group, vif);
+
+    // The querier of the VIF sends the queries, if it is not us...
+    Dp = getIfByVifIndex(vif);
+    if(Dp == NULL || !isQuerier(Dp)) {
+        return;
+    }
+
+    if(nsrcs > (int)IGMPV3_MAX_QUERY_SRCS) {
+        nsrcs = IGMPV3_MAX_QUERY_SRCS;
+    }
+
+    sqDesc = (SourceQueryDesc*) malloc(sizeof(SourceQueryDesc) + nsrcs * sizeof(uint32_t));
+    if(sqDesc == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    sqDesc->group = group;
+    sqDesc->vif   = vif;
+    sqDesc->count = conf->lastMemberQueryCount;
+    sqDesc->nsrcs = nsrcs;
+    memcpy(sqDesc->sources, sources, nsrcs * sizeof(uint32_t));
+
+    sendSourceQueryRound(sqDesc);
+}
+
+/**
+*   Sends a general membership query on a single downstream VIF.
+*   The argument is an allocated VIF index, which is freed.
+*/
+static void sendVifGeneralQuery(void *argument) {
+    struct  Config  *conf = getCommonConfig();
+    struct  IfDesc  *Dp;
+
+    Dp = getIfByVifIndex(*(unsigned *)argument);
+    free(argument);
+
+    // The VIF may be gone, or another router may be querying it...
+    if(Dp == NULL || Dp->state != IF_STATE_DOWNSTREAM || !isQuerier(Dp)) {
+        return;
+    }
+
+    // Send the membership query...
+    sendIgmpV3Query(Dp->InAdr.s_addr, allhosts_group, 0,
+             conf->queryResponseInterval * IGMP_TIMER_SCALE,
+             0, 0, NULL);
+
+    my_log(LOG_DEBUG, 0,
+        "Sent membership query from %s to %s. Delay: %d",
+        inetFmt(Dp->InAdr.s_addr,s1),
+        inetFmt(allhosts_group,s2),
+        conf->queryResponseInterval);
 }
 
+/**
+*   Adjusts the query interval, response interval and robustness to
+*   the membership activity seen during the last query interval.
+*   A stable membership with many reports gets longer intervals and
+*   response windows, as long as the group membership interval stays
+*   within the configured leave detection target. Churn and groups
+*   that went silent bring the intervals back down, and silent groups
+*   also raise the robustness. The leave detection target always
+*   wins over the other bounds.
+*/
+static void adaptQueryTimers(void) {
+    static unsigned baseInterval, baseResponse, baseRobustness;
+    struct  Config  *conf = getCommonConfig();
+    unsigned        interval, response, robustness, minInterval, maxInterval;
+
+    if(baseInterval == 0) {
+        baseInterval   = conf->queryInterval;
+        baseResponse   = conf->queryResponseInterval;
+        baseRobustness = conf->robustnessValue;
+    }
+    interval   = conf->queryInterval;
+    response   = conf->queryResponseInterval;
+    robustness = conf->robustnessValue;
+
+    if(lostCount > 0) {
+        // Reports seem to get lost...
+        interval = interval * 3 / 4;
+        response = baseResponse;
+        if(robustness < 7) {
+            robustness++;
+        }
+    } else if(churnCount * 4 > reportCount) {
+        // Groups are churning...
+        interval = interval * 3 / 4;
+        response = baseResponse;
+    } else if(reportCount > 0) {
+        // Stable membership...
+        interval = interval * 5 / 4;
+        if(robustness > baseRobustness) {
+            robustness--;
+        }
+        // Widen the response window when reports come in bursts.
+        if(reportCount > response * 10 && response < baseResponse * 4) {
+            response++;
+        } else if(response > baseResponse) {
+            response--;
+        }
+    }
+
+    // Give back the wider window and extra robustness the target cannot afford...
+    while(response + robustness * (response + 1) > conf->adaptiveLatency &&
+          (response > baseResponse || robustness > baseRobustness)) {
+        if(response > baseResponse) {
+            response--;
+        } else {
+            robustness--;
+        }
+    }
+
+    // Keep the group membership interval within the leave detection target...
+    maxInterval = baseInterval * 4;
+    if(conf->adaptiveLatency > response && (conf->adaptiveLatency - response) / robustness < maxInterval) {
+        maxInterval = (conf->adaptiveLatency - response) / robustness;
+    }
+    minInterval = baseInterval / 2 < maxInterval ? baseInterval / 2 : maxInterval;
+    if(minInterval < response + 1) {
+        minInterval = response + 1;
+    }
+    if(interval > maxInterval) {
+        interval = maxInterval;
+    }
+    if(interval < minInterval) {
+        interval = minInterval;
+    }
+    if(interval > maxInterval) {
+        my_log(LOG_WARNING, 0, "Leave detection within %u seconds cannot be met, the query interval is %u.",
+            conf->adaptiveLatency, interval);
+    }
+
+    if(interval != conf->queryInterval || response != conf->queryResponseInterval ||
+       robustness != conf->robustnessValue) {
+        my_log(LOG_INFO, 0, "Adapting query timers to %u reports, %u changes and %u silent groups: "
+            "interval %u, response %u, robustness %u.", reportCount, churnCount, lostCount,
+            interval, response, robustness);
+    }
+    conf->queryInterval         = interval;
+    conf->queryResponseInterval = response;
+    conf->robustnessValue       = robustness;
+
+    reportCount = churnCount = lostCount = 0;
+}
 
 /**
-*   Sends a general membership query on downstream VIFs
+*   Sends a general membership query on downstream VIFs. The
+*   queries are staggered with some jitter over the first part of
+*   the query interval, so the reports of all VIFs do not arrive at
+*   the same time. Routes are aged when the last VIF has had its
+*   response interval.
 */
 void sendGeneralMembershipQuery(void) {
     struct  Config  *conf = getCommonConfig();
     struct  IfDesc  *Dp;
-    int             Ix;
-
-    // Loop through all downstream vifs...
-    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-        if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) ) {
-            if(Dp->state == IF_STATE_DOWNSTREAM) {
-                // Send the membership query...
-                sendIgmp(Dp->InAdr.s_addr, allhosts_group,
-                         IGMP_MEMBERSHIP_QUERY,
-                         conf->queryResponseInterval * IGMP_TIMER_SCALE, 0, 0);
-
-                my_log(LOG_DEBUG, 0,
-                    "Sent membership query from %s to %s. Delay: %d",
-                    inetFmt(Dp->InAdr.s_addr,s1),
-                    inetFmt(allhosts_group,s2),
-                    conf->queryResponseInterval);
+    unsigned        *vif;
+    int             Ix, n, k, interval, spread, delay;
+
+    // Silent hosts give their groups back to the caps...
+    expireReporters();
+
+    if(conf->adaptiveLatency > 0 && conf->startupQueryCount == 0) {
+        adaptQueryTimers();
+    }
+
+    interval = conf->startupQueryCount > 0 ? conf->startupQueryInterval : conf->queryInterval;
+    spread = interval > (int)conf->queryResponseInterval
+           ? (interval - (int)conf->queryResponseInterval) / 2 : 0;
+
+    // Count the downstream vifs...
+    for ( Ix = 0, n = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
+        if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) && Dp->state == IF_STATE_DOWNSTREAM ) {
+            n++;
+        }
+    }
+
+    // ...and give each its own slot of the spread.
+    for ( Ix = 0, k = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
+        if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) && Dp->state == IF_STATE_DOWNSTREAM ) {
+            delay = k * spread / n;
+            if(spread >= n * 2) {
+                delay += random() % (spread / n);
+            }
+            k++;
+
+            vif = (unsigned *) malloc(sizeof(unsigned));
+            if(vif == NULL) {
+                my_log(LOG_ERR, 0, "Out of memory.");
+            }
+            *vif = Dp->index;
+
+            if(delay == 0) {
+                sendVifGeneralQuery(vif);
+            } else {
+                timer_setTimer(delay, sendVifGeneralQuery, vif);
             }
         }
     }
 
     // Install timer for aging active routes.
-    timer_setTimer(conf->queryResponseInterval, (timer_f)ageActiveRoutes, NULL);
+    timer_setTimer(spread + conf->queryResponseInterval, (timer_f)ageActiveRoutes, NULL);
 
     // Install timer for next general query...
     if(conf->startupQueryCount>0) {
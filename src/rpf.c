@@ -0,0 +1,300 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   rpf.c
+*
+*   Reverse path lookups for multicast sources. The unicast routes of
+*   the kernel main table are read with an RTM_GETROUTE dump into a
+*   longest prefix match trie, which maps a source to the interface
+*   the kernel would route it over. Route change notifications mark
+*   the trie stale, and it is read again from a timer a moment later,
+*   so a burst of changes costs one dump, and lookups never wait for
+*   one. The stale trie is used until a dump completes.
+*
+*   Tables too large to mirror are looked at again after a while, and
+*   mirrored once they have shrunk.
+*
+*   Without rtnetlink, no source resolves, and the altnet lists of
+*   the upstream interfaces are used instead.
+*/
+
+#include "igmpproxy.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/rtnetlink.h>
+#endif
+
+#define RPF_MAX_ROUTES      65536   // Larger tables are not mirrored
+#define RPF_NO_ROUTE        0       // Trie value of unreachable prefixes
+#define RPF_RELOAD_DELAY    1       // Seconds to gather route changes before a reload
+#define RPF_OVERFLOW_RETRY  60      // Seconds between reloads of a table too large
+
+static struct LpmNode   *rpfTrie;
+static int              rpfStale = 1;
+static int              rpfOverflow;        // The table was too large to mirror
+static int              rpfReloadScheduled;
+static int              rpfEventSock = -1;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/**
+*   Adds one route of the dump to the trie. Returns 1 if it was
+*   taken, 0 if it is not a main table IPv4 route.
+*/
+static int addRpfRoute(struct LpmNode **trie, struct nlmsghdr *nh) {
+    struct rtmsg        *rtm = NLMSG_DATA(nh);
+    struct rtattr       *rta;
+    struct rtnexthop    *rtnh;
+    uint32_t            dst = 0;
+    int                 alen = RTM_PAYLOAD(nh), oif = RPF_NO_ROUTE;
+
+    if(rtm->rtm_family != AF_INET || rtm->rtm_table != RT_TABLE_MAIN || rtm->rtm_dst_len > 32) {
+        return 0;
+    }
+
+    for(rta = RTM_RTA(rtm); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+        switch(rta->rta_type) {
+        case RTA_DST:
+            memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+            break;
+        case RTA_OIF:
+            memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+            break;
+        case RTA_MULTIPATH:
+            // Multipath routes resolve to their first next hop.
+            rtnh = RTA_DATA(rta);
+            if(RTA_PAYLOAD(rta) >= sizeof(*rtnh)) {
+                oif = rtnh->rtnh_ifindex;
+            }
+            break;
+        }
+    }
+
+    // Unreachable and blackhole routes shadow shorter prefixes...
+    if(rtm->rtm_type != RTN_UNICAST) {
+        oif = RPF_NO_ROUTE;
+    }
+
+    lpmInsert(trie, dst, rtm->rtm_dst_len, oif);
+    return 1;
+}
+
+/**
+*   Reads the kernel main routing table into a new trie, which
+*   replaces the current one once the dump is complete. Returns 0 if
+*   the dump failed, and the current trie stays stale.
+*/
+static int loadRpfRoutes(void) {
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg    rtm;
+    } req;
+    char                buf[16384];
+    struct LpmNode      *trie = NULL;
+    struct nlmsghdr     *nh;
+    struct timeval      tv = { 1, 0 };
+    int                 sock, len, routes = 0, done = 0, failed = 0;
+
+    sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(sock < 0) {
+        my_log(LOG_WARNING, errno, "Unable to open route lookup socket.");
+        return 0;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len    = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nh.nlmsg_type   = RTM_GETROUTE;
+    req.nh.nlmsg_flags  = NLM_F_REQUEST | NLM_F_DUMP;
+    req.rtm.rtm_family  = AF_INET;
+    req.rtm.rtm_table   = RT_TABLE_MAIN;
+    if(send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+        my_log(LOG_WARNING, errno, "Unable to request the routing table.");
+        close(sock);
+        return 0;
+    }
+
+    while(!done && !failed && routes <= RPF_MAX_ROUTES) {
+        len = recv(sock, buf, sizeof(buf), 0);
+        if(len <= 0) {
+            my_log(LOG_WARNING, errno, "Routing table dump was cut short.");
+            failed = 1;
+            break;
+        }
+        for(nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len)) {
+            if(nh->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+                break;
+            }
+            if(nh->nlmsg_type == NLMSG_ERROR) {
+                my_log(LOG_WARNING, 0, "Routing table dump failed.");
+                failed = 1;
+                break;
+            }
+            if(nh->nlmsg_type == RTM_NEWROUTE) {
+                routes += addRpfRoute(&trie, nh);
+            }
+        }
+    }
+    close(sock);
+
+    if(failed) {
+        lpmFree(&trie);
+        return 0;
+    }
+
+    // Too large a table is left to altnet, until it shrinks...
+    lpmFree(&rpfTrie);
+    rpfStale = 0;
+    if(!done || routes > RPF_MAX_ROUTES) {
+        lpmFree(&trie);
+        if(!rpfOverflow) {
+            my_log(LOG_WARNING, 0, "Routing table has more than %d routes. Using altnet for sources.",
+                RPF_MAX_ROUTES);
+            rpfOverflow = 1;
+        }
+        return 1;
+    }
+    if(rpfOverflow) {
+        my_log(LOG_NOTICE, 0, "Routing table is down to %d routes. Using it for sources again.", routes);
+        rpfOverflow = 0;
+    }
+
+    // ...otherwise the new trie takes over.
+    rpfTrie = trie;
+    my_log(LOG_DEBUG, 0, "Loaded %d routes for reverse path lookups.", routes);
+    return 1;
+}
+
+static void scheduleRpfReload(void);
+
+/**
+*   Reads the routes again after they have changed. A failed dump
+*   is retried.
+*/
+static void reloadRpfRoutes(void *arg) {
+    (void)arg;
+    rpfReloadScheduled = 0;
+
+    if(rpfStale && !loadRpfRoutes()) {
+        scheduleRpfReload();
+    }
+}
+
+/**
+*   Schedules a reload of the routes, unless one is pending. Tables
+*   too large to mirror are looked at less often.
+*/
+static void scheduleRpfReload(void) {
+    if(!rpfReloadScheduled) {
+        timer_setTimer(rpfOverflow ? RPF_OVERFLOW_RETRY : RPF_RELOAD_DELAY, reloadRpfRoutes, NULL);
+        rpfReloadScheduled = 1;
+    }
+}
+#endif
+
+/**
+*   Returns the index into upStreamIfIdx of the upstream interface a
+*   source is routed over, or -1 if the kernel routes it over none.
+*/
+int rpfUpstream(uint32_t src) {
+    struct IfDesc   *Dp;
+    int             oif, i;
+
+    if(!lpmLookup(rpfTrie, src, &oif) || oif == RPF_NO_ROUTE) {
+        return -1;
+    }
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        Dp = getIfByIx( upStreamIfIdx[i] );
+        if(Dp != NULL && Dp->ifIndex == (unsigned)oif) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+*   Returns the socket route changes come in on, or -1 if there is none.
+*/
+int getRpfSock(void) {
+    return rpfEventSock;
+}
+
+/**
+*   Reads the pending route change notifications, and schedules a
+*   reload of the routes when one concerns the IPv4 main table.
+*/
+void acceptRpfEvent(void) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+    char                buf[8192];
+    struct nlmsghdr     *nh;
+    struct rtmsg        *rtm;
+    int                 len;
+
+    while((len = recv(rpfEventSock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for(nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len)) {
+            if(nh->nlmsg_type != RTM_NEWROUTE && nh->nlmsg_type != RTM_DELROUTE) {
+                continue;
+            }
+            rtm = NLMSG_DATA(nh);
+            if(rtm->rtm_family == AF_INET && rtm->rtm_table == RT_TABLE_MAIN) {
+                rpfStale = 1;
+            }
+        }
+    }
+    if(len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        // Notifications were lost, so the routes can't be trusted.
+        my_log(LOG_WARNING, errno, "recv route changes");
+        rpfStale = 1;
+    }
+    if(rpfStale) {
+        scheduleRpfReload();
+    }
+#endif
+}
+
+/**
+*   Subscribes to route change notifications, and reads the routes.
+*/
+void initRpf(void) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+    struct sockaddr_nl sa;
+
+    rpfEventSock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(rpfEventSock < 0) {
+        my_log(LOG_WARNING, errno, "Unable to open route change socket. Using altnet for sources.");
+        return;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_IPV4_ROUTE;
+    if(bind(rpfEventSock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        my_log(LOG_WARNING, errno, "Unable to bind route change socket. Using altnet for sources.");
+        close(rpfEventSock);
+        rpfEventSock = -1;
+        return;
+    }
+
+    // Changes from here on are notified, so the dump misses none.
+    if(!loadRpfRoutes()) {
+        scheduleRpfReload();
+    }
+#endif
+}
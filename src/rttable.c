@@ -40,8 +40,6 @@
 
 #include "igmpproxy.h"
 
-#define MAX_ORIGINS 4
-
 /**
 *   Routing table structure definition. Double linked list...
 */
@@ -55,11 +53,28 @@ struct RouteTable {
     // Keeps the upstream membership state...
     short               upstrState;     // Upstream membership state.
     int                 upstrVif;       // Upstream Vif Index.
+    uint32_t            upstrJoinedBits; // Bits representing the upstreams (upStreamIfIdx) joined on.
 
     // These parameters contain aging details.
     uint32_t            ageVifBits;     // Bits representing aging VIFs.
     int                 ageValue;       // Downcounter for death.
     int                 ageActivity;    // Records any acitivity that notes there are still listeners.
+    uint32_t            lastMemberBits; // Bits representing VIFs in last member check.
+
+    // Upstream hold-down after the last listener has gone...
+    time_t              holdUntil;      // When the route is removed, 0 if not held.
+    short               preJoined;      // Joined upstream for its popularity.
+
+    // Static groups...
+    uint32_t            pinnedVifBits;  // Bits representing VIFs pinned by staticgroup.
+    uint32_t            pinnedSources[MAX_ORIGINS]; // Sources for pinned VIFs, none for all.
+
+    // Set while the route waits to be replayed after an upstream recovery.
+    short               replay;
+
+    // Bandwidth admission, from the bitrate stanzas...
+    unsigned int        bitrate;        // Bitrate of the group in kbit/s, 0 if not given.
+    int                 priority;       // Groups of a lower priority can be pre-empted.
 };
 
 
@@ -74,6 +89,20 @@ int internUpdateKernelRoute(struct RouteTable *route, int activate);
 // Socket for sending join or leave requests.
 int mcGroupSock = 0;
 
+// Set while the hold-down expiry timer is pending.
+static int holdDownScheduled;
+
+// Routes replayed per pass of the main loop after an upstream recovery.
+#define REPLAY_BATCH        64
+
+// Set while routes are waiting to be replayed.
+static int replayScheduled;
+
+// Bandwidth of the groups listened to on each VIF, in kbit/s, and the joins it turned away.
+static unsigned long committedBandwidth[MAX_MC_VIFS];
+static unsigned long refusedJoins[MAX_MC_VIFS];
+static unsigned long preemptedGroups[MAX_MC_VIFS];
+
 
 /**
 *   Function for retrieving the Multicast Group socket.
@@ -112,76 +141,169 @@ void initRouteTable(void) {
     }
 }
 
+/**
+*   Joins or leaves a group on one upstream interface, through the
+*   kernel or the own report engine. Groups with an SSM mapping are
+*   joined for the mapped sources only.
+*/
+static void joinLeaveUpstreamIf(struct IfDesc *upstrIf, uint32_t group, int join) {
+    struct Config       *conf = getCommonConfig();
+    uint32_t            sources[MAX_ORIGINS];
+    int                 nsrcs, i;
+
+    nsrcs = getSsmSources(group, sources);
+
+    //k_join(group, upstrIf->InAdr.s_addr);
+    if(conf->upstreamReports) {
+        reportUpstreamMembership( upstrIf, group, join, nsrcs, sources );
+    } else if(nsrcs == 0) {
+        if(join) {
+            joinMcGroup( getMcGroupSock(), upstrIf, group );
+        } else {
+            leaveMcGroup( getMcGroupSock(), upstrIf, group );
+        }
+    } else {
+        for(i = 0; i < nsrcs; i++) {
+            if(join) {
+                joinMcSourceGroup( getMcGroupSock(), upstrIf, group, sources[i] );
+            } else {
+                leaveMcSourceGroup( getMcGroupSock(), upstrIf, group, sources[i] );
+            }
+        }
+    }
+}
+
+/**
+*   Selects the single upstream a group is pulled over: one of the
+*   live upstreams whose whitelist allows the group, picked by a hash
+*   of the group. Returns the index into upStreamIfIdx, or -1 if no
+*   live upstream allows the group.
+*/
+static int selectUpstream(uint32_t group) {
+    struct IfDesc*      upstrIf;
+    int                 allowed[MAX_UPS_VIFS], usable[MAX_UPS_VIFS];
+    int                 i, n = 0, u = 0;
+    uint32_t            hash = ntohl(group) * 2654435761u;
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        upstrIf = getIfByIx( upStreamIfIdx[i] );
+        if(upstrIf != NULL && isGroupAllowedForIf(upstrIf, group)) {
+            allowed[n++] = i;
+            if(upstreamUsable(i)) {
+                usable[u++] = i;
+            }
+        }
+    }
+    if(u == 0) {
+        return -1;
+    }
+
+    // Keep the choice stable while all upstreams are alive, only the
+    // groups of a dead upstream are spread over the others.
+    i = allowed[hash % n];
+    return upstreamUsable(i) ? i : usable[hash % u];
+}
+
 /**
 *   Internal function to send join or leave requests for
-*   a specified route upstream...
+*   a specified route upstream. A group is joined on one upstream
+*   only, unless joinallupstreams is set. The membership on each
+*   upstream is kept in upstrJoinedBits, so leaves go exactly where
+*   joins went.
 */
 static void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
+    struct Config       *conf = getCommonConfig();
     struct IfDesc*      upstrIf;
-    int i;
-
-    for(i=0; i<MAX_UPS_VIFS; i++)
-    {
-        if (-1 != upStreamIfIdx[i])
-        {
-            // Get the upstream IF...
-            upstrIf = getIfByIx( upStreamIfIdx[i] );
-            if(upstrIf == NULL) {
-                my_log(LOG_ERR, 0 ,"FATAL: Unable to get Upstream IF.");
+    int                 i, chosen = -1;
+
+    if(join) {
+        // Only join a group if there are listeners downstream, or it is popular or held...
+        if(route->vifBits == 0 && !route->preJoined && !route->holdUntil) {
+            my_log(LOG_DEBUG, 0, "No downstream listeners for group %s. No join sent.",
+                inetFmt(route->group, s1));
+            return;
+        }
+        if(!conf->joinAllUpstreams) {
+            // The group stays on the upstream it is pulled over...
+            if(route->upstrJoinedBits) {
+                return;
             }
+            chosen = selectUpstream(route->group);
+            if(chosen < 0) {
+                my_log(LOG_INFO, 0, "The group address %s may not be forwarded on any live upstream. Ignoring.",
+                    inetFmt(route->group, s1));
+                return;
+            }
+        }
+    }
 
-            // Check if there is a white list for the upstram VIF
-            if (upstrIf->allowedgroups != NULL) {
-              uint32_t           group = route->group;
-                struct SubnetList* sn;
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        // Get the upstream IF...
+        upstrIf = getIfByIx( upStreamIfIdx[i] );
+        if(upstrIf == NULL) {
+            my_log(LOG_ERR, 0 ,"FATAL: Unable to get Upstream IF.");
+        }
 
-                // Check if this Request is legit to be forwarded to upstream
-                for(sn = upstrIf->allowedgroups; sn != NULL; sn = sn->next)
-                    if((group & sn->subnet_mask) == sn->subnet_addr)
-                        // Forward is OK...
-                        break;
+        // Send join or leave request...
+        if(join) {
+            if(BIT_TST(route->upstrJoinedBits, i) || !upstreamUsable(i)) {
+                continue;
+            }
+            // The chosen upstream allows the group, the others are only checked when all are joined.
+            if(!conf->joinAllUpstreams && i != chosen) {
+                continue;
+            }
+            if(!isGroupAllowedForIf(upstrIf, route->group)) {
+                my_log(LOG_INFO, 0, "The group address %s may not be forwarded upstream on %s. Ignoring.",
+                    inetFmt(route->group, s1), upstrIf->Name);
+                continue;
+            }
 
-                if (sn == NULL) {
-                    my_log(LOG_INFO, 0, "The group address %s may not be forwarded upstream. Ignoring.", inetFmt(group, s1));
-                    return;
-                }
+            my_log(LOG_DEBUG, 0, "Joining group %s upstream on IF address %s",
+                         inetFmt(route->group, s1),
+                         inetFmt(upstrIf->InAdr.s_addr, s2));
+
+            joinLeaveUpstreamIf( upstrIf, route->group, 1 );
+            BIT_SET(route->upstrJoinedBits, i);
+        } else {
+            // Only leave where the group is joined...
+            if(!BIT_TST(route->upstrJoinedBits, i)) {
+                continue;
             }
 
-            // Send join or leave request...
-            if(join) {
-                // Only join a group if there are listeners downstream...
-                if(route->vifBits > 0) {
-                    my_log(LOG_DEBUG, 0, "Joining group %s upstream on IF address %s",
-                                 inetFmt(route->group, s1),
-                                 inetFmt(upstrIf->InAdr.s_addr, s2));
-
-                    //k_join(route->group, upstrIf->InAdr.s_addr);
-                    joinMcGroup( getMcGroupSock(), upstrIf, route->group );
-
-                    route->upstrState = ROUTESTATE_JOINED;
-                } else {
-                    my_log(LOG_DEBUG, 0, "No downstream listeners for group %s. No join sent.",
-                        inetFmt(route->group, s1));
-                }
-            } else {
-                // Only leave if group is not left already...
-                if(route->upstrState != ROUTESTATE_NOTJOINED) {
-                    my_log(LOG_DEBUG, 0, "Leaving group %s upstream on IF address %s",
-                                 inetFmt(route->group, s1),
-                                 inetFmt(upstrIf->InAdr.s_addr, s2));
+            my_log(LOG_DEBUG, 0, "Leaving group %s upstream on IF address %s",
+                         inetFmt(route->group, s1),
+                         inetFmt(upstrIf->InAdr.s_addr, s2));
 
-                    //k_leave(route->group, upstrIf->InAdr.s_addr);
-                    leaveMcGroup( getMcGroupSock(), upstrIf, route->group );
+            joinLeaveUpstreamIf( upstrIf, route->group, 0 );
+            BIT_CLR(route->upstrJoinedBits, i);
+        }
+    }
 
-                    route->upstrState = ROUTESTATE_NOTJOINED;
-                }
-            }
+    route->upstrState = route->upstrJoinedBits ? ROUTESTATE_JOINED : ROUTESTATE_NOTJOINED;
+}
+
+/**
+*   Sets the listening VIFs of a route, and moves the bitrate of
+*   the group in or out of the committed bandwidth of the VIFs
+*   that changed.
+*/
+static void setRouteVifs(struct RouteTable *croute, uint32_t vifBits) {
+    uint32_t    changed = croute->vifBits ^ vifBits;
+    int         ifx;
+
+    for(ifx = 0; changed != 0 && ifx < MAX_MC_VIFS; ifx++) {
+        if(!BIT_TST(changed, ifx)) {
+            continue;
         }
-        else
-        {
-            i = MAX_UPS_VIFS;
+        if(BIT_TST(vifBits, ifx)) {
+            committedBandwidth[ifx] += croute->bitrate;
+        } else {
+            committedBandwidth[ifx] -= croute->bitrate;
         }
+        BIT_CLR(changed, ifx);
     }
+    croute->vifBits = vifBits;
 }
 
 /**
@@ -208,6 +330,7 @@ void clearAllRoutes(void) {
         sendJoinLeaveUpstream(croute, 0);
 
         // Clear memory, and set pointer to next route...
+        setRouteVifs(croute, 0);
         free(croute);
     }
     routing_table = NULL;
@@ -232,6 +355,59 @@ static struct RouteTable *findRoute(uint32_t group) {
     return NULL;
 }
 
+/**
+*   Admits a new listening VIF of a group within the bandwidth
+*   budget of the VIF. When the group does not fit, groups of a
+*   lower priority are pre-empted from the VIF, lowest first, if
+*   that makes room. Returns 0 if the join is refused.
+*/
+static int admitRouteVif(uint32_t group, int ifx) {
+    struct IfDesc       *Dp = getIfByVifIndex(ifx);
+    struct RouteTable   *croute, *victim;
+    unsigned long       bitrate, preemptable = 0;
+    int                 priority;
+
+    bitrate = getGroupBitrate(group, &priority);
+    if(Dp == NULL || Dp->bandwidth == 0 || bitrate == 0 ||
+       committedBandwidth[ifx] + bitrate <= Dp->bandwidth) {
+        return 1;
+    }
+
+    // See what the groups of a lower priority would give back...
+    for(croute = routing_table; croute; croute = croute->nextroute) {
+        if(croute->priority < priority && BIT_TST(croute->vifBits, ifx) &&
+           !BIT_TST(croute->pinnedVifBits, ifx)) {
+            preemptable += croute->bitrate;
+        }
+    }
+    if(committedBandwidth[ifx] - preemptable + bitrate > Dp->bandwidth) {
+        refusedJoins[ifx]++;
+        my_log(LOG_INFO, 0, "Group %s needs %lu kbit/s, but %lu of %u kbit/s are committed on %s. Refusing it.",
+            inetFmt(group, s1), bitrate, committedBandwidth[ifx], Dp->bandwidth, Dp->Name);
+        return 0;
+    }
+
+    // ...and pre-empt them, lowest priority first, until the group fits.
+    while(committedBandwidth[ifx] + bitrate > Dp->bandwidth) {
+        victim = NULL;
+        for(croute = routing_table; croute; croute = croute->nextroute) {
+            if(croute->priority < priority && croute->bitrate > 0 && BIT_TST(croute->vifBits, ifx) &&
+               !BIT_TST(croute->pinnedVifBits, ifx) && (victim == NULL || croute->priority < victim->priority)) {
+                victim = croute;
+            }
+        }
+        if(victim == NULL) {
+            break;
+        }
+
+        my_log(LOG_NOTICE, 0, "Pre-empting group %s on %s for %s.",
+            inetFmt(victim->group, s1), Dp->Name, inetFmt(group, s2));
+        preemptedGroups[ifx]++;
+        forgetGroupOnVif(victim->group, ifx);
+    }
+    return 1;
+}
+
 /**
 *   Adds a specified route to the routingtable.
 *   If the route already exists, the existing route
@@ -256,6 +432,12 @@ int insertRoute(uint32_t group, int ifx) {
         return 0;
     }
 
+    // A new listening VIF must fit in its bandwidth budget...
+    croute = findRoute(group);
+    if(ifx >= 0 && (croute == NULL || !BIT_TST(croute->vifBits, ifx)) && !admitRouteVif(group, ifx)) {
+        return 0;
+    }
+
     // Try to find an existing route for this group...
     croute = findRoute(group);
     if(croute==NULL) {
@@ -276,17 +458,25 @@ int insertRoute(uint32_t group, int ifx) {
 
         // The group is not joined initially.
         newroute->upstrState = ROUTESTATE_NOTJOINED;
+        BIT_ZERO(newroute->upstrJoinedBits);
 
         // The route is not active yet, so the age is unimportant.
         newroute->ageValue    = conf->robustnessValue;
         newroute->ageActivity = 0;
 
         BIT_ZERO(newroute->ageVifBits);     // Initially we assume no listeners.
+        BIT_ZERO(newroute->lastMemberBits);
+        newroute->holdUntil = 0;
+        newroute->preJoined = 0;
+        BIT_ZERO(newroute->pinnedVifBits);
+        memset(newroute->pinnedSources, 0, sizeof(newroute->pinnedSources));
+        newroute->replay = 0;
+        newroute->bitrate = getGroupBitrate(group, &newroute->priority);
 
         // Set the listener flag...
         BIT_ZERO(newroute->vifBits);    // Initially no listeners...
         if(ifx >= 0) {
-            BIT_SET(newroute->vifBits, ifx);
+            setRouteVifs(newroute, 1 << ifx);
         }
 
         // Check if there is a table already....
@@ -341,14 +531,33 @@ int insertRoute(uint32_t group, int ifx) {
         my_log(LOG_INFO, 0, "Inserted route table entry for %s on VIF #%d",
             inetFmt(croute->group, s1),ifx);
 
+        if(ifx >= 0) {
+            notePopularity(group);
+        }
+
     } else if(ifx >= 0) {
 
+        // A new listening VIF counts for the popularity of the group.
+        if(!BIT_TST(croute->vifBits, ifx)) {
+            notePopularity(group);
+        }
+
         // The route exists already, so just update it.
-        BIT_SET(croute->vifBits, ifx);
+        setRouteVifs(croute, croute->vifBits | 1 << ifx);
 
         // Register the VIF activity for the aging routine
         BIT_SET(croute->ageVifBits, ifx);
 
+        // A report ends any last member check on the VIF.
+        BIT_CLR(croute->lastMemberBits, ifx);
+
+        // ...and a listener coming back cancels the pending upstream leave.
+        if(croute->holdUntil) {
+            my_log(LOG_DEBUG, 0, "Listener for held group %s is back. Cancelling leave.",
+                inetFmt(croute->group, s1));
+            croute->holdUntil = 0;
+        }
+
         // Log the cleanup in debugmode...
         my_log(LOG_INFO, 0, "Updated route entry for %s on VIF #%d",
             inetFmt(croute->group, s1), ifx);
@@ -371,6 +580,24 @@ int insertRoute(uint32_t group, int ifx) {
     return 1;
 }
 
+/**
+*   Registers a repeated report for a group on a VIF with the aging
+*   routine only. Returns 0 if the VIF is not a settled listener of
+*   the route, and the report needs a full insertRoute().
+*/
+int refreshRouteAge(uint32_t group, int ifx) {
+    struct RouteTable*  croute;
+
+    croute = findRoute(group);
+    if(croute == NULL || !BIT_TST(croute->vifBits, ifx) || BIT_TST(croute->lastMemberBits, ifx) ||
+       croute->holdUntil || croute->upstrState != ROUTESTATE_JOINED) {
+        return 0;
+    }
+
+    BIT_SET(croute->ageVifBits, ifx);
+    return 1;
+}
+
 /**
 *   Activates a passive group. If the group is already
 *   activated, it's reinstalled in the kernel. If
@@ -428,8 +655,8 @@ int activateRoute(uint32_t group, uint32_t originAddr, int upstrVif) {
         }
         croute->upstrVif = upstrVif;
 
-        // Only update kernel table if there are listeners !
-        if(croute->vifBits > 0) {
+        // Only update kernel table if there are listeners, or the group is kept joined !
+        if(croute->vifBits > 0 || croute->preJoined || croute->holdUntil) {
             result = internUpdateKernelRoute(croute, 1);
         }
     }
@@ -454,11 +681,24 @@ void ageActiveRoutes(void) {
         // Keep the next route (since current route may be removed)...
         nroute = croute->nextroute;
 
-        // Run the aging round algorithm.
-        if(croute->upstrState != ROUTESTATE_CHECK_LAST_MEMBER) {
-            // Only age routes if Last member probe is not active...
-            internAgeRoute(croute);
+        // Held and pre-joined routes may have no listeners left to age...
+        if(croute->holdUntil || (croute->preJoined && croute->vifBits == 0)) {
+            continue;
+        }
+
+        // Static groups are refreshed instead of aged...
+        if(croute->pinnedVifBits) {
+            if(croute->upstrState != ROUTESTATE_JOINED) {
+                sendJoinLeaveUpstream(croute, 1);
+            }
+            internUpdateKernelRoute(croute, 1);
         }
+
+        // VIFs in the last member check are aged by their own query cycle, pinned VIFs not at all...
+        croute->ageVifBits |= croute->lastMemberBits | croute->pinnedVifBits;
+
+        // Run the aging round algorithm.
+        internAgeRoute(croute);
     }
     logRouteTable("Age active routes");
 }
@@ -483,47 +723,51 @@ int numberOfInterfaces(struct RouteTable *croute) {
 
 /**
 *   Should be called when a leave message is received, to
-*   mark a route for the last member probe state.
+*   mark a VIF of a route for the last member probe state.
+*   Other VIFs of the route are not affected.
 */
-void setRouteLastMemberMode(uint32_t group) {
+void setRouteLastMemberMode(uint32_t group, int ifx) {
     struct Config       *conf = getCommonConfig();
     struct RouteTable   *croute;
 
     croute = findRoute(group);
-    if(croute!=NULL) {
-        // Check for fast leave mode...
-        if(croute->upstrState == ROUTESTATE_JOINED && conf->fastUpstreamLeave) {
+    if(croute!=NULL && BIT_TST(croute->vifBits, ifx) && !BIT_TST(croute->pinnedVifBits, ifx)) {
+        // Check for fast leave mode, which the hold-down overrides...
+        if(croute->upstrState == ROUTESTATE_JOINED && conf->fastUpstreamLeave && !conf->holdDown) {
             // Send a leave message right away only when the route has been active on only one interface
             if (numberOfInterfaces(croute) <= 1) {
-                my_log(LOG_DEBUG, 0, "Leaving group %d now", group);
+                my_log(LOG_DEBUG, 0, "Leaving group %s now", inetFmt(group, s1));
                 sendJoinLeaveUpstream(croute, 0);
             }
         }
 
-        // Set the routingstate to Last member check...
-        croute->upstrState = ROUTESTATE_CHECK_LAST_MEMBER;
-
-        // Set the count value for expiring... (-1 since first aging)
-        croute->ageValue = conf->lastMemberQueryCount;
+        // Set the VIF to Last member check...
+        BIT_SET(croute->lastMemberBits, ifx);
     }
 }
 
 
 /**
-*   Ages groups in the last member check state. If the
-*   route is not found, or not in this state, 0 is returned.
+*   Ages a VIF of a group in the last member check state. Returns 1
+*   while the check should go on, and 0 when a report has ended it,
+*   or the route is gone. On the final round the VIF is removed from
+*   the route.
 */
-int lastMemberGroupAge(uint32_t group) {
+int lastMemberGroupAge(uint32_t group, int ifx, int final) {
     struct RouteTable   *croute;
 
     croute = findRoute(group);
-    if(croute!=NULL) {
-        if(croute->upstrState == ROUTESTATE_CHECK_LAST_MEMBER) {
-            return !internAgeRoute(croute);
-        } else {
-            return 0;
-        }
+    if(croute==NULL || !BIT_TST(croute->lastMemberBits, ifx)) {
+        return 0;
+    }
+    if(!final) {
+        return 1;
     }
+
+    my_log(LOG_DEBUG, 0, "No members of %s left on VIF #%d.", inetFmt(group, s1), ifx);
+
+    BIT_CLR(croute->lastMemberBits, ifx);
+    removeRouteVif(group, ifx);
     return 0;
 }
 
@@ -532,7 +776,6 @@ int lastMemberGroupAge(uint32_t group) {
 *   and 0 if route was not found.
 */
 static int removeRoute(struct RouteTable*  croute) {
-    struct Config       *conf = getCommonConfig();
     int result = 1;
 
     // If croute is null, no routes was found.
@@ -553,9 +796,7 @@ static int removeRoute(struct RouteTable*  croute) {
     }
 
     // Send Leave request upstream if group is joined
-    if(croute->upstrState == ROUTESTATE_JOINED || 
-       (croute->upstrState == ROUTESTATE_CHECK_LAST_MEMBER && !conf->fastUpstreamLeave)) 
-    {
+    if(croute->upstrState == ROUTESTATE_JOINED) {
         sendJoinLeaveUpstream(croute, 0);
     }
 
@@ -574,6 +815,7 @@ static int removeRoute(struct RouteTable*  croute) {
         }
     }
     // Free the memory, and set the route to NULL...
+    setRouteVifs(croute, 0);
     free(croute);
     croute = NULL;
 
@@ -583,6 +825,381 @@ static int removeRoute(struct RouteTable*  croute) {
 }
 
 
+/**
+*   Removes the held routes whose hold-down has run out, and
+*   schedules itself for the next one.
+*/
+static void expireHeldRoutes(void *arg) {
+    struct RouteTable   *croute, *nroute;
+    time_t              now = monotonicTime(), next = 0;
+
+    (void)arg;
+    holdDownScheduled = 0;
+
+    for(croute = routing_table; croute != NULL; croute = nroute) {
+        nroute = croute->nextroute;
+        if(!croute->holdUntil) {
+            continue;
+        }
+        if(croute->holdUntil <= now) {
+            my_log(LOG_DEBUG, 0, "Hold-down of group %s ran out.", inetFmt(croute->group, s1));
+            croute->holdUntil = 0;
+            if(!croute->preJoined) {
+                removeRoute(croute);
+            }
+        } else if(next == 0 || croute->holdUntil < next) {
+            next = croute->holdUntil;
+        }
+    }
+
+    if(next) {
+        timer_setTimer(next - now, expireHeldRoutes, NULL);
+        holdDownScheduled = 1;
+    }
+}
+
+/**
+*   Called when the last listener of a route is gone. With a
+*   hold-down configured, a joined route stays joined upstream
+*   and in the kernel, without output VIFs, until the hold-down
+*   runs out. Otherwise the route is removed at once.
+*/
+static void releaseRoute(struct RouteTable *croute) {
+    struct Config       *conf = getCommonConfig();
+
+    // Pre-joined routes stay, without output VIFs...
+    if(croute->preJoined && croute->upstrState == ROUTESTATE_JOINED) {
+        setRouteVifs(croute, 0);
+        BIT_ZERO(croute->ageVifBits);
+        BIT_ZERO(croute->lastMemberBits);
+        internUpdateKernelRoute(croute, 1);
+        logRouteTable("Keep pre-joined route");
+        return;
+    }
+
+    if(conf->holdDown == 0 || croute->upstrState != ROUTESTATE_JOINED) {
+        removeRoute(croute);
+        return;
+    }
+
+    if(!croute->holdUntil) {
+        my_log(LOG_DEBUG, 0, "No listeners left for %s. Holding it for %d seconds.",
+            inetFmt(croute->group, s1), conf->holdDown);
+        croute->holdUntil = monotonicTime() + conf->holdDown;
+        setRouteVifs(croute, 0);
+        BIT_ZERO(croute->ageVifBits);
+        BIT_ZERO(croute->lastMemberBits);
+        internUpdateKernelRoute(croute, 1);
+        logRouteTable("Hold route");
+    }
+
+    if(!holdDownScheduled) {
+        timer_setTimer(conf->holdDown, expireHeldRoutes, NULL);
+        holdDownScheduled = 1;
+    }
+}
+
+/**
+*   Removes a single downstream VIF from the route of a group,
+*   and updates the kernel route. If no VIFs are left, the route
+*   is removed.
+*/
+void removeRouteVif(uint32_t group, int ifx) {
+    struct RouteTable   *croute;
+
+    croute = findRoute(group);
+    if(croute == NULL || !BIT_TST(croute->vifBits, ifx) || BIT_TST(croute->pinnedVifBits, ifx)) {
+        return;
+    }
+
+    my_log(LOG_DEBUG, 0, "Removing VIF #%d from route entry for %s",
+                 ifx, inetFmt(group, s1));
+
+    setRouteVifs(croute, croute->vifBits & ~(1 << ifx));
+    BIT_CLR(croute->ageVifBits, ifx);
+    BIT_CLR(croute->lastMemberBits, ifx);
+
+    if(croute->vifBits == 0) {
+        releaseRoute(croute);
+    } else {
+        internUpdateKernelRoute(croute, 1);
+        logRouteTable("Remove route VIF");
+    }
+}
+
+/**
+*   Reinstalls the kernel routes of a group, after
+*   the sources wanted by its VIFs have changed.
+*/
+void refreshRoute(uint32_t group) {
+    struct RouteTable   *croute;
+
+    croute = findRoute(group);
+    if(croute != NULL && croute->vifBits > 0) {
+        internUpdateKernelRoute(croute, 1);
+    }
+}
+
+/**
+*   Returns the VIF index the traffic of a route comes in on: its
+*   current upstream VIF while it is joined there, else the first
+*   upstream it is joined on, or -1 if it is not joined upstream.
+*/
+static int joinedUpstreamVif(struct RouteTable *route) {
+    int i, ix, vif = -1;
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        if(BIT_TST(route->upstrJoinedBits, i)) {
+            ix = getIfByIx( upStreamIfIdx[i] )->index;
+            if(ix == route->upstrVif) {
+                return ix;
+            }
+            if(vif == -1) {
+                vif = ix;
+            }
+        }
+    }
+    return vif;
+}
+
+/**
+*   Moves the groups joined on a failed upstream to the surviving
+*   upstreams, and points their kernel routes at the new upstream.
+*   Returns the number of groups moved.
+*/
+int migrateUpstream(int upstream) {
+    struct RouteTable   *croute;
+    struct IfDesc       *deadIf = getIfByIx( upStreamIfIdx[upstream] );
+    int                 vif, moved = 0;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        if(!BIT_TST(croute->upstrJoinedBits, upstream)) {
+            continue;
+        }
+
+        // Drop the membership on the dead link, so it is not pulled there when the link returns...
+        joinLeaveUpstreamIf( deadIf, croute->group, 0 );
+        BIT_CLR(croute->upstrJoinedBits, upstream);
+        croute->upstrState = croute->upstrJoinedBits ? ROUTESTATE_JOINED : ROUTESTATE_NOTJOINED;
+
+        // ...and join on a live one.
+        sendJoinLeaveUpstream(croute, 1);
+
+        // The traffic now comes in on the new upstream.
+        vif = joinedUpstreamVif(croute);
+        if(vif != -1 && vif != croute->upstrVif) {
+            croute->upstrVif = vif;
+            internUpdateKernelRoute(croute, 1);
+        }
+
+        if(croute->upstrJoinedBits) {
+            moved++;
+        }
+    }
+    logRouteTable("Migrate Upstream");
+
+    return moved;
+}
+
+/**
+*   Replays the upstream joins and kernel routes of the routes that
+*   wait for it, REPLAY_BATCH at a time. Reschedules itself without
+*   delay while routes are left, so the main loop gets to handle its
+*   sockets between the batches.
+*/
+static void replayRoutes(void *arg) {
+    struct Config       *conf = getCommonConfig();
+    struct RouteTable   *croute;
+    int                 vif, done = 0;
+
+    (void)arg;
+    replayScheduled = 0;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        if(!croute->replay) {
+            continue;
+        }
+        if(done == REPLAY_BATCH) {
+            timer_setTimer(0, replayRoutes, NULL);
+            replayScheduled = 1;
+            break;
+        }
+        croute->replay = 0;
+        done++;
+
+        // Join the groups the upstreams that came back should carry...
+        if(croute->upstrState != ROUTESTATE_JOINED || conf->joinAllUpstreams) {
+            sendJoinLeaveUpstream(croute, 1);
+        }
+
+        // ...and reinstall the kernel routes of active groups.
+        vif = joinedUpstreamVif(croute);
+        if(vif != -1) {
+            croute->upstrVif = vif;
+        }
+        if(croute->vifBits > 0 || croute->preJoined || croute->holdUntil) {
+            internUpdateKernelRoute(croute, 1);
+        }
+    }
+}
+
+/**
+*   Replays the upstream joins and kernel routes of all routes, after
+*   an upstream came back from a failure or a link flap. Groups that
+*   lost all their upstreams are joined again, and the kernel routes
+*   the link flap may have dropped are reinstalled. Returns the number
+*   of routes replayed.
+*/
+int replayUpstream(int upstream) {
+    struct RouteTable   *croute;
+    int                 count = 0;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        croute->replay = 1;
+        count++;
+    }
+    if(count > 0 && !replayScheduled) {
+        timer_setTimer(0, replayRoutes, NULL);
+        replayScheduled = 1;
+    }
+    my_log(LOG_DEBUG, 0, "Replaying %d routes after recovery of upstream %d.", count, upstream);
+
+    return count;
+}
+
+/**
+*   Installs the groups pinned by staticgroup stanzas. The groups
+*   are joined upstream, and when sources are given their kernel
+*   routes are installed right away, without waiting for traffic.
+*   A static group is admitted against the bandwidth of a VIF like
+*   any other; a VIF that refuses it is not pinned.
+*/
+void installStaticGroups(void) {
+    struct StaticGroup  *sg;
+    struct RouteTable   *croute;
+    struct IfDesc       *Dp;
+    int                 i;
+
+    for(sg = getStaticGroups(); sg != NULL; sg = sg->next) {
+        for(i = 0; i < sg->nifs; i++) {
+            Dp = getIfByName(sg->ifnames[i]);
+            if(Dp == NULL || Dp->state != IF_STATE_DOWNSTREAM || Dp->index >= MAX_MC_VIFS) {
+                my_log(LOG_WARNING, 0, "Static group %s: %s is not a downstream interface.",
+                    inetFmt(sg->group, s1), sg->ifnames[i]);
+                continue;
+            }
+            if(!insertRoute(sg->group, Dp->index) || (croute = findRoute(sg->group)) == NULL) {
+                my_log(LOG_WARNING, 0, "Static group %s could not be installed on %s.",
+                    inetFmt(sg->group, s1), Dp->Name);
+                continue;
+            }
+            BIT_SET(croute->pinnedVifBits, Dp->index);
+        }
+
+        croute = findRoute(sg->group);
+        if(croute == NULL || croute->pinnedVifBits == 0) {
+            continue;
+        }
+        memcpy(croute->pinnedSources, sg->sources, sizeof(croute->pinnedSources));
+
+        my_log(LOG_INFO, 0, "Pinned static group %s on VIFs 0x%08x",
+            inetFmt(sg->group, s1), croute->pinnedVifBits);
+
+        // Install the forwarding state for known sources...
+        preinstallRoute(sg->group, sg->nsources, sg->sources);
+    }
+}
+
+/**
+*   Installs the kernel routes of known sources of a group with
+*   listeners, before any traffic has arrived. Sources that already
+*   have routes are left alone.
+*/
+void preinstallRoute(uint32_t group, int nsrcs, uint32_t *sources) {
+    struct RouteTable   *croute;
+    int                 i, j, vif;
+
+    croute = findRoute(group);
+    if(croute == NULL) {
+        return;
+    }
+
+    // The traffic comes in on the upstream the group is joined on.
+    vif = joinedUpstreamVif(croute);
+    if(vif == -1 && upStreamIfIdx[0] != -1) {
+        vif = getIfByIx( upStreamIfIdx[0] )->index;
+    }
+
+    for(i = 0; i < nsrcs; i++) {
+        for(j = 0; j < MAX_ORIGINS; j++) {
+            if(croute->originAddrs[j] == sources[i]) {
+                break;
+            }
+        }
+        if(j == MAX_ORIGINS) {
+            activateRoute(group, sources[i], vif);
+        }
+    }
+}
+
+/**
+*   Keeps a group joined upstream without downstream listeners, or
+*   stops doing so. A route is created for the group if needed.
+*/
+void setRoutePreJoin(uint32_t group, int on) {
+    struct RouteTable   *croute;
+
+    croute = findRoute(group);
+    if(on) {
+        if(croute == NULL) {
+            insertRoute(group, -1);
+            croute = findRoute(group);
+            if(croute == NULL) {
+                return;
+            }
+        }
+        croute->preJoined = 1;
+        if(croute->upstrState != ROUTESTATE_JOINED) {
+            sendJoinLeaveUpstream(croute, 1);
+        }
+    } else if(croute != NULL && croute->preJoined) {
+        croute->preJoined = 0;
+        if(croute->vifBits == 0 && !croute->holdUntil) {
+            removeRoute(croute);
+        }
+    }
+}
+
+/**
+*   Sums the bytes the kernel has forwarded for a group, over all
+*   its origins. Returns 0 if the group has no installed routes.
+*/
+int getRouteBytes(uint32_t group, unsigned long *bytes) {
+    struct RouteTable   *croute;
+    struct MRouteDesc   mrDesc;
+    unsigned long       count;
+    int                 i, found = 0;
+
+    croute = findRoute(group);
+    if(croute == NULL) {
+        return 0;
+    }
+
+    *bytes = 0;
+    for(i = 0; i < MAX_ORIGINS; i++) {
+        if(croute->originAddrs[i] == 0) {
+            continue;
+        }
+        mrDesc.McAdr.s_addr     = group;
+        mrDesc.OriginAdr.s_addr = croute->originAddrs[i];
+        if(getMRouteBytes(&mrDesc, &count) == 0) {
+            *bytes += count;
+            found = 1;
+        }
+    }
+    return found;
+}
+
 /**
 *   Ages a specific route
 */
@@ -605,7 +1222,7 @@ int internAgeRoute(struct RouteTable*  croute) {
             croute->ageActivity++;
 
             // Update the actual bits for the route...
-            croute->vifBits = croute->ageVifBits;
+            setRouteVifs(croute, croute->ageVifBits);
         }
     }
     // Check if there have been activity in aging process...
@@ -614,7 +1231,7 @@ int internAgeRoute(struct RouteTable*  croute) {
         // If the bits are different in this round, we must
         if(croute->vifBits != croute->ageVifBits) {
             // Or the bits together to insure we don't lose any listeners.
-            croute->vifBits |= croute->ageVifBits;
+            setRouteVifs(croute, croute->vifBits | croute->ageVifBits);
 
             // Register changes in this round as well..
             croute->ageActivity++;
@@ -641,7 +1258,7 @@ int internAgeRoute(struct RouteTable*  croute) {
                          inetFmt(croute->group,s1));
 
             // No activity was registered within the timelimit, so remove the route.
-            removeRoute(croute);
+            releaseRoute(croute);
         }
         // Tell that the route was updated...
         result = 1;
@@ -653,6 +1270,40 @@ int internAgeRoute(struct RouteTable*  croute) {
     return result;
 }
 
+/**
+*   Returns true if a source of a route is forwarded to a VIF
+*   because the VIF is pinned by a staticgroup stanza.
+*/
+static int pinnedForwards(struct RouteTable *route, int ifx, uint32_t source) {
+    int i;
+
+    if(!BIT_TST(route->pinnedVifBits, ifx)) {
+        return 0;
+    }
+    if(route->pinnedSources[0] == 0) {
+        return 1;
+    }
+    for(i = 0; i < MAX_ORIGINS && route->pinnedSources[i] != 0; i++) {
+        if(route->pinnedSources[i] == source) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+*   Returns true if a source of a route is forwarded to a listening
+*   VIF, for its hosts or for its staticgroup pin. A VIF that is only
+*   kept by a pin with sources takes just those sources.
+*/
+static int vifForwards(struct RouteTable *route, int ifx, uint32_t source) {
+    if(BIT_TST(route->pinnedVifBits, ifx) && route->pinnedSources[0] != 0 &&
+       !hasSourceFilter(route->group, ifx)) {
+        return pinnedForwards(route, ifx, source);
+    }
+    return sourceFilterForwards(route->group, ifx, source) || pinnedForwards(route, ifx, source);
+}
+
 /**
 *   Updates the Kernel routing table. If activate is 1, the route
 *   is (re-)activated. If activate is false, the route is removed.
@@ -685,7 +1336,8 @@ int internUpdateKernelRoute(struct RouteTable *route, int activate) {
             if(Dp->state == IF_STATE_UPSTREAM) {
                 continue;
             }
-            else if(BIT_TST(route->vifBits, Dp->index)) {
+            else if(BIT_TST(route->vifBits, Dp->index) &&
+                    vifForwards(route, Dp->index, route->originAddrs[i])) {
                 my_log(LOG_DEBUG, 0, "Setting TTL for Vif %d to %d", Dp->index, Dp->threshold);
                 mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
             }
@@ -759,3 +1411,21 @@ int interfaceInRoute(int32_t group, int Ix) {
         return 0;
     }
 }
+
+/**
+*   Logs the committed bandwidth, and the refused joins and pre-empted
+*   groups, of the interfaces with a bandwidth budget.
+*/
+void logBandwidth(void) {
+    struct IfDesc   *Dp;
+    unsigned        Ix;
+
+    for(Ix = 0; (Dp = getIfByIx(Ix)); Ix++) {
+        if(Dp->state != IF_STATE_DOWNSTREAM || Dp->bandwidth == 0) {
+            continue;
+        }
+        my_log(LOG_NOTICE, 0, "Bandwidth on %s: %lu of %u kbit/s committed, %lu joins refused, "
+            "%lu groups pre-empted.", Dp->Name, committedBandwidth[Dp->index], Dp->bandwidth,
+            refusedJoins[Dp->index], preemptedGroups[Dp->index]);
+    }
+}
@@ -0,0 +1,559 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   srctable.c
+*
+*   Keeps the IGMPv3 source filter state of every group on every
+*   downstream VIF. The state is changed by the group records in
+*   received reports, and aged with the router side source and
+*   group timers described in RFC 3376 section 6.
+*/
+
+#include "igmpproxy.h"
+#include "igmpv3.h"
+
+#define SRCTABLE_HASH_SIZE  256
+
+/**
+*   A source in the source list of a group. In INCLUDE mode all
+*   listed sources are forwarded. In EXCLUDE mode the sources with
+*   a running timer are forwarded, and the ones whose timer is not
+*   running (expires == 0) are blocked.
+*/
+struct SourceRecord {
+    struct SourceRecord *next;
+    uint32_t            source;
+    time_t              expires;        // Source timer. 0 if not running.
+};
+
+/**
+*   Filter state for a group on one VIF.
+*/
+struct GroupVifState {
+    struct GroupVifState *next;
+    uint32_t            group;
+    int                 vif;
+    short               filterMode;     // IGMPV3_FMODE_INCLUDE or IGMPV3_FMODE_EXCLUDE
+    time_t              groupExpires;   // Group timer. Only used in EXCLUDE mode.
+    struct SourceRecord *sources;
+};
+
+// Hash table of all filter states, keyed on group and VIF.
+static struct GroupVifState *srcTable[SRCTABLE_HASH_SIZE];
+
+// Timer for the next expiry sweep, and when it runs.
+static int      sweepTimer = 0;
+static time_t   sweepTime = 0;
+
+// Prototypes
+static void sweepSourceFilters(void *argument);
+
+/**
+*   Returns the hash bucket for a group on a VIF.
+*/
+static unsigned srcTableHash(uint32_t group, int vif) {
+    return (ntohl(group) * 31 + vif) % SRCTABLE_HASH_SIZE;
+}
+
+/**
+*   Group membership interval (RFC 3376 8.4).
+*/
+static time_t groupMembershipInterval(void) {
+    struct Config *conf = getCommonConfig();
+    return conf->robustnessValue * conf->queryInterval + conf->queryResponseInterval;
+}
+
+/**
+*   Last member query time (RFC 3376 8.9).
+*/
+static time_t lastMemberQueryTime(void) {
+    struct Config *conf = getCommonConfig();
+    return conf->lastMemberQueryInterval * conf->lastMemberQueryCount;
+}
+
+/**
+*   Finds the filter state for a group on a VIF.
+*/
+static struct GroupVifState *findState(uint32_t group, int vif) {
+    struct GroupVifState *st;
+
+    for(st = srcTable[srcTableHash(group, vif)]; st; st = st->next) {
+        if(st->group == group && st->vif == vif) {
+            return st;
+        }
+    }
+    return NULL;
+}
+
+/**
+*   Creates an empty INCLUDE state for a group on a VIF.
+*/
+static struct GroupVifState *createState(uint32_t group, int vif) {
+    struct GroupVifState *st;
+    unsigned bucket = srcTableHash(group, vif);
+
+    st = (struct GroupVifState*)malloc(sizeof(struct GroupVifState));
+    if(st == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    st->group        = group;
+    st->vif          = vif;
+    st->filterMode   = IGMPV3_FMODE_INCLUDE;
+    st->groupExpires = 0;
+    st->sources      = NULL;
+
+    st->next = srcTable[bucket];
+    srcTable[bucket] = st;
+
+    return st;
+}
+
+/**
+*   Unlinks a filter state from the table and frees it.
+*/
+static void deleteState(struct GroupVifState *st) {
+    struct GroupVifState **stp;
+    struct SourceRecord *sr;
+
+    for(stp = &srcTable[srcTableHash(st->group, st->vif)]; *stp; stp = &(*stp)->next) {
+        if(*stp == st) {
+            *stp = st->next;
+            break;
+        }
+    }
+    while((sr = st->sources) != NULL) {
+        st->sources = sr->next;
+        free(sr);
+    }
+    free(st);
+}
+
+static struct SourceRecord *findSource(struct GroupVifState *st, uint32_t source) {
+    struct SourceRecord *sr;
+
+    for(sr = st->sources; sr; sr = sr->next) {
+        if(sr->source == source) {
+            return sr;
+        }
+    }
+    return NULL;
+}
+
+static struct SourceRecord *addSource(struct GroupVifState *st, uint32_t source, time_t expires) {
+    struct SourceRecord *sr;
+
+    sr = (struct SourceRecord*)malloc(sizeof(struct SourceRecord));
+    if(sr == NULL) {
+        my_log(LOG_ERR, 0, "Out of memory.");
+    }
+    sr->source  = source;
+    sr->expires = expires;
+    sr->next    = st->sources;
+    st->sources = sr;
+
+    return sr;
+}
+
+static int inSourceList(uint32_t source, int nsrcs, struct in_addr *sources) {
+    int i;
+
+    for(i = 0; i < nsrcs; i++) {
+        if(sources[i].s_addr == source) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+*   Sets the timer of the listed sources, adding the ones
+*   not yet in the source list.
+*/
+static void setSourceTimers(struct GroupVifState *st, int nsrcs, struct in_addr *sources, time_t expires) {
+    struct SourceRecord *sr;
+    int i;
+
+    for(i = 0; i < nsrcs; i++) {
+        sr = findSource(st, sources[i].s_addr);
+        if(sr == NULL) {
+            addSource(st, sources[i].s_addr, expires);
+        } else {
+            sr->expires = expires;
+        }
+    }
+}
+
+/**
+*   Deletes all sources that are not in the given list.
+*/
+static void deleteSourcesNotIn(struct GroupVifState *st, int nsrcs, struct in_addr *sources) {
+    struct SourceRecord **srp, *sr;
+
+    for(srp = &st->sources; (sr = *srp) != NULL; ) {
+        if(!inSourceList(sr->source, nsrcs, sources)) {
+            *srp = sr->next;
+            free(sr);
+        } else {
+            srp = &sr->next;
+        }
+    }
+}
+
+/**
+*   Returns the earliest running timer of a filter state,
+*   or 0 if no timers are running.
+*/
+static time_t nextExpiry(struct GroupVifState *st) {
+    struct SourceRecord *sr;
+    time_t next = 0;
+
+    if(st->filterMode == IGMPV3_FMODE_EXCLUDE) {
+        next = st->groupExpires;
+    }
+    for(sr = st->sources; sr; sr = sr->next) {
+        if(sr->expires && (next == 0 || sr->expires < next)) {
+            next = sr->expires;
+        }
+    }
+    return next;
+}
+
+/**
+*   Makes sure the expiry sweep runs no later than 'expires'.
+*/
+static void scheduleSweep(time_t expires) {
+    time_t now = monotonicTime();
+
+    if(expires == 0 || (sweepTimer && sweepTime <= expires)) {
+        return;
+    }
+    if(sweepTimer) {
+        timer_clearTimer(sweepTimer);
+    }
+    sweepTime  = expires;
+    sweepTimer = timer_setTimer(expires > now ? expires - now : 0, sweepSourceFilters, NULL);
+}
+
+/**
+*   Lowers the timers of the given sources to the last member
+*   query time, and asks the hosts on the VIF if anyone still
+*   wants them (RFC 3376 6.6.3.2).
+*/
+static void querySources(struct GroupVifState *st, uint32_t *sources, int nsrcs) {
+    time_t expires = monotonicTime() + lastMemberQueryTime();
+    struct SourceRecord *sr;
+    int i;
+
+    if(nsrcs == 0) {
+        return;
+    }
+    for(i = 0; i < nsrcs; i++) {
+        sr = findSource(st, sources[i]);
+        if(sr != NULL && sr->expires > expires) {
+            sr->expires = expires;
+        }
+    }
+    sendGroupSourceQuery(st->group, st->vif, nsrcs, sources);
+}
+
+/**
+*   Debug function that writes a filter state to the log.
+*/
+static void logSourceFilter(struct GroupVifState *st) {
+    struct SourceRecord *sr;
+    time_t now = monotonicTime();
+
+    my_log(LOG_DEBUG, 0, "Source filter for %s on VIF #%d: %s, group timer %d",
+        inetFmt(st->group, s1), st->vif,
+        st->filterMode == IGMPV3_FMODE_INCLUDE ? "INCLUDE" : "EXCLUDE",
+        st->filterMode == IGMPV3_FMODE_EXCLUDE ? (int)(st->groupExpires - now) : 0);
+    for(sr = st->sources; sr; sr = sr->next) {
+        my_log(LOG_DEBUG, 0, "    Src: %s, timer %d", inetFmt(sr->source, s1),
+            sr->expires ? (int)(sr->expires - now) : 0);
+    }
+}
+
+/**
+*   Applies an IGMPv3 group record received on a VIF to the filter
+*   state of the group, following the router state tables in RFC
+*   3376 section 6.4. Returns true if the VIF still wants any
+*   source of the group afterwards.
+*
+*   An empty TO_IN record is a leave. It only lowers the timers here,
+*   the group specific queries are sent by the last member cycle.
+*/
+int updateSourceFilter(uint32_t group, int vif, int type, int nsrcs, struct in_addr *sources) {
+    struct GroupVifState *st;
+    struct SourceRecord *sr;
+    uint32_t query[IGMPV3_MAX_QUERY_SRCS];
+    int nquery = 0, i;
+    time_t now = monotonicTime();
+    time_t gmi = now + groupMembershipInterval();
+
+    st = findState(group, vif);
+    if(st == NULL) {
+        // Records that don't ask for anything create no state...
+        if(type == IGMPV3_BLOCK_OLD_SOURCES ||
+           (nsrcs == 0 && (type == IGMPV3_MODE_IS_INCLUDE ||
+                           type == IGMPV3_CHANGE_TO_INCLUDE ||
+                           type == IGMPV3_ALLOW_NEW_SOURCES))) {
+            return 0;
+        }
+        st = createState(group, vif);
+    }
+
+    switch(type) {
+    case IGMPV3_MODE_IS_INCLUDE:
+    case IGMPV3_ALLOW_NEW_SOURCES:
+        // INCLUDE (A+B), EXCLUDE (X+A,Y-A). The reported sources are set to GMI.
+        setSourceTimers(st, nsrcs, sources, gmi);
+        break;
+
+    case IGMPV3_CHANGE_TO_INCLUDE:
+        // Query the running sources that were not reported, Q(G,A-B) or Q(G,X-A).
+        for(sr = st->sources; sr && nquery < (int)IGMPV3_MAX_QUERY_SRCS; sr = sr->next) {
+            if(sr->expires && !inSourceList(sr->source, nsrcs, sources)) {
+                query[nquery++] = sr->source;
+            }
+        }
+        setSourceTimers(st, nsrcs, sources, gmi);
+
+        // In EXCLUDE mode the whole group is queried, Q(G).
+        if(st->filterMode == IGMPV3_FMODE_EXCLUDE) {
+            if(st->groupExpires > now + lastMemberQueryTime()) {
+                st->groupExpires = now + lastMemberQueryTime();
+            }
+            if(nsrcs > 0) {
+                sendGroupSourceQuery(group, vif, 0, NULL);
+            }
+        }
+        break;
+
+    case IGMPV3_BLOCK_OLD_SOURCES:
+        // INCLUDE: Q(G,A*B). EXCLUDE: (A-X-Y)=Group Timer, Q(G,A-Y).
+        for(i = 0; i < nsrcs && nquery < (int)IGMPV3_MAX_QUERY_SRCS; i++) {
+            sr = findSource(st, sources[i].s_addr);
+            if(sr == NULL && st->filterMode == IGMPV3_FMODE_EXCLUDE) {
+                sr = addSource(st, sources[i].s_addr, st->groupExpires);
+            }
+            if(sr != NULL && sr->expires) {
+                query[nquery++] = sr->source;
+            }
+        }
+        break;
+
+    case IGMPV3_MODE_IS_EXCLUDE:
+    case IGMPV3_CHANGE_TO_EXCLUDE:
+        // Delete (A-B), or (X-A) and (Y-A).
+        deleteSourcesNotIn(st, nsrcs, sources);
+
+        for(i = 0; i < nsrcs; i++) {
+            sr = findSource(st, sources[i].s_addr);
+            if(sr == NULL) {
+                // INCLUDE: (B-A)=0. EXCLUDE: (A-X-Y)=GMI on IS_EX, Group Timer on TO_EX.
+                if(st->filterMode == IGMPV3_FMODE_INCLUDE) {
+                    sr = addSource(st, sources[i].s_addr, 0);
+                } else {
+                    sr = addSource(st, sources[i].s_addr,
+                                   type == IGMPV3_MODE_IS_EXCLUDE ? gmi : st->groupExpires);
+                }
+            }
+            // TO_EX queries the sources that are still running, Q(G,A*B) or Q(G,A-Y).
+            if(type == IGMPV3_CHANGE_TO_EXCLUDE && sr->expires && nquery < (int)IGMPV3_MAX_QUERY_SRCS) {
+                query[nquery++] = sr->source;
+            }
+        }
+        st->filterMode   = IGMPV3_FMODE_EXCLUDE;
+        st->groupExpires = gmi;
+        break;
+
+    default:
+        return st->filterMode == IGMPV3_FMODE_EXCLUDE || st->sources != NULL;
+    }
+
+    querySources(st, query, nquery);
+
+    if(st->filterMode == IGMPV3_FMODE_INCLUDE && st->sources == NULL) {
+        deleteState(st);
+        return 0;
+    }
+
+    logSourceFilter(st);
+    scheduleSweep(nextExpiry(st));
+
+    return 1;
+}
+
+/**
+*   Returns true if hosts on the VIF have reported the group, so
+*   there is filter state for it.
+*/
+int hasSourceFilter(uint32_t group, int vif) {
+    return findState(group, vif) != NULL;
+}
+
+/**
+*   Returns true if traffic from 'source' to 'group' should be
+*   forwarded on the VIF. VIFs without any filter state for the
+*   group take any source.
+*/
+int sourceFilterForwards(uint32_t group, int vif, uint32_t source) {
+    struct GroupVifState *st;
+    struct SourceRecord *sr;
+
+    st = findState(group, vif);
+    if(st == NULL) {
+        return 1;
+    }
+    sr = findSource(st, source);
+    if(st->filterMode == IGMPV3_FMODE_INCLUDE) {
+        return sr != NULL;
+    }
+    return sr == NULL || sr->expires != 0;
+}
+
+/**
+*   Tells how a query retransmission for a source of a group, or for
+*   the group itself if 'source' is 0, should be sent (RFC 3376 6.6.3).
+*   Returns 1 if the timer is above the last member query time, so the
+*   query gets the Suppress Router-Side Processing flag, 0 if it is
+*   not, and -1 if there is nothing left to query.
+*/
+int sourceFilterSuppress(uint32_t group, int vif, uint32_t source) {
+    struct GroupVifState *st;
+    struct SourceRecord *sr;
+    time_t expires;
+
+    st = findState(group, vif);
+    if(st == NULL) {
+        return -1;
+    }
+    if(source == 0) {
+        if(st->filterMode != IGMPV3_FMODE_EXCLUDE) {
+            return -1;
+        }
+        expires = st->groupExpires;
+    } else {
+        sr = findSource(st, source);
+        if(sr == NULL || sr->expires == 0) {
+            return -1;
+        }
+        expires = sr->expires;
+    }
+    return expires > monotonicTime() + lastMemberQueryTime();
+}
+
+/**
+*   Expires source and group timers. In INCLUDE mode sources are
+*   removed when their timer runs out, in EXCLUDE mode they are
+*   blocked. When the group timer runs out in EXCLUDE mode the state
+*   goes back to INCLUDE mode with the sources that are still
+*   running. A VIF left with no sources is removed from the route.
+*/
+static void sweepSourceFilters(void *argument) {
+    struct GroupVifState *st, *nst;
+    struct SourceRecord **srp, *sr;
+    time_t now = monotonicTime();
+    time_t next = 0, expires;
+    unsigned bucket;
+    int changed;
+
+    (void)argument;
+    sweepTimer = 0;
+
+    for(bucket = 0; bucket < SRCTABLE_HASH_SIZE; bucket++) {
+        for(st = srcTable[bucket]; st; st = nst) {
+            nst = st->next;
+            changed = 0;
+
+            if(st->filterMode == IGMPV3_FMODE_EXCLUDE && st->groupExpires <= now) {
+                my_log(LOG_DEBUG, 0, "Group timer for %s on VIF #%d expired. Going to INCLUDE mode.",
+                    inetFmt(st->group, s1), st->vif);
+                st->filterMode = IGMPV3_FMODE_INCLUDE;
+                changed = 1;
+            }
+
+            for(srp = &st->sources; (sr = *srp) != NULL; ) {
+                if(sr->expires == 0 ? st->filterMode == IGMPV3_FMODE_INCLUDE : sr->expires <= now) {
+                    changed = 1;
+                    if(st->filterMode == IGMPV3_FMODE_INCLUDE) {
+                        *srp = sr->next;
+                        free(sr);
+                        continue;
+                    }
+                    sr->expires = 0;
+                }
+                srp = &sr->next;
+            }
+
+            if(st->filterMode == IGMPV3_FMODE_INCLUDE && st->sources == NULL) {
+                uint32_t group = st->group;
+                int      vif   = st->vif;
+
+                my_log(LOG_DEBUG, 0, "No sources left for %s on VIF #%d.",
+                    inetFmt(group, s1), vif);
+                deleteState(st);
+                removeRouteVif(group, vif);
+                continue;
+            }
+
+            if(changed) {
+                logSourceFilter(st);
+                refreshRoute(st->group);
+            }
+
+            expires = nextExpiry(st);
+            if(expires && (next == 0 || expires < next)) {
+                next = expires;
+            }
+        }
+    }
+
+    scheduleSweep(next);
+}
+
+/**
+*   Removes the filter state of a group on one VIF.
+*/
+void clearSourceFilter(uint32_t group, int vif) {
+    struct GroupVifState *st;
+
+    st = findState(group, vif);
+    if(st != NULL) {
+        deleteState(st);
+    }
+}
+
+/**
+*   Removes all source filter state.
+*/
+void clearSourceFilters(void) {
+    unsigned bucket;
+
+    if(sweepTimer) {
+        timer_clearTimer(sweepTimer);
+        sweepTimer = 0;
+    }
+    for(bucket = 0; bucket < SRCTABLE_HASH_SIZE; bucket++) {
+        while(srcTable[bucket] != NULL) {
+            deleteState(srcTable[bucket]);
+        }
+    }
+}
@@ -0,0 +1,251 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+*/
+/**
+*   upstream.c
+*
+*   Watches the liveness of the upstream interfaces. An upstream is
+*   dead when its link loses carrier, or when the queries of its
+*   querier stop coming for longer than the configured timeout. The
+*   groups joined on a dead upstream are moved to a surviving one,
+*   and all groups are replayed when it comes back.
+*
+*   Link state changes are taken from rtnetlink where available, and
+*   polled once a second otherwise.
+*/
+
+#include "igmpproxy.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/rtnetlink.h>
+#endif
+
+#define LINK_POLL_INTERVAL      1       // Seconds between link state checks
+
+/**
+*   The liveness of an upstream interface.
+*/
+struct UpstreamLink {
+    short       linkDown;       // The link has no carrier
+    short       queryLost;      // The upstream queries timed out
+    short       down;           // The upstream is not used
+    time_t      lastQuery;      // Time of the last upstream query, 0 if none heard
+};
+
+static struct UpstreamLink  links[MAX_UPS_VIFS];
+static int                  linkSock = -1;
+
+/**
+*   Returns the index into upStreamIfIdx of an interface, or -1 if it
+*   is not an upstream interface.
+*/
+static int upstreamIndex(struct IfDesc *Dp) {
+    int i;
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        if(getIfByIx(upStreamIfIdx[i]) == Dp) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+*   Returns true if groups may be joined on an upstream.
+*/
+int upstreamUsable(int upstream) {
+    return !links[upstream].down;
+}
+
+/**
+*   Acts on a change in the liveness of an upstream. On failure, its
+*   groups are moved to the surviving upstreams.
+*/
+static void updateUpstream(int upstream) {
+    struct UpstreamLink *ul = &links[upstream];
+    struct IfDesc       *Dp = getIfByIx(upStreamIfIdx[upstream]);
+    short               down = ul->linkDown || ul->queryLost;
+
+    if(down == ul->down) {
+        return;
+    }
+    ul->down = down;
+
+    if(down) {
+        my_log(LOG_WARNING, 0, "Upstream interface %s is down. Moved %d groups.",
+            Dp->Name, migrateUpstream(upstream));
+    } else {
+        my_log(LOG_NOTICE, 0, "Upstream interface %s is up. Replaying %d groups.",
+            Dp->Name, replayUpstream(upstream));
+    }
+}
+
+/**
+*   Records the link state of an interface.
+*/
+static void setLinkState(struct IfDesc *Dp, int running) {
+    int upstream = upstreamIndex(Dp);
+
+    if(upstream < 0 || links[upstream].linkDown == !running) {
+        return;
+    }
+    my_log(LOG_DEBUG, 0, "Link state of upstream %s: %s", Dp->Name,
+        running ? "running" : "no carrier");
+    links[upstream].linkDown = !running;
+    updateUpstream(upstream);
+}
+
+/**
+*   Records that a query was heard on an upstream interface.
+*/
+void noteUpstreamQuery(struct IfDesc *Dp) {
+    int upstream = upstreamIndex(Dp);
+
+    if(upstream < 0) {
+        return;
+    }
+    links[upstream].lastQuery = monotonicTime();
+    if(links[upstream].queryLost) {
+        my_log(LOG_NOTICE, 0, "Queries are back on upstream %s.", Dp->Name);
+        links[upstream].queryLost = 0;
+        updateUpstream(upstream);
+    }
+}
+
+/**
+*   Reads the link state of an interface from the kernel.
+*/
+static void pollLinkState(struct IfDesc *Dp) {
+    struct ifreq IfReq;
+
+    memset(&IfReq, 0, sizeof(IfReq));
+    memcpy(IfReq.ifr_name, Dp->Name, sizeof(IfReq.ifr_name));
+    if(ioctl(getMcGroupSock(), SIOCGIFFLAGS, &IfReq) < 0) {
+        my_log(LOG_WARNING, errno, "ioctl SIOCGIFFLAGS for %s", Dp->Name);
+        return;
+    }
+    setLinkState(Dp, (IfReq.ifr_flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING));
+}
+
+/**
+*   Polls the link state when there are no link events, and times
+*   out silent upstream queriers.
+*/
+static void checkUpstreams(void *arg) {
+    struct Config   *conf = getCommonConfig();
+    time_t          now = monotonicTime();
+    int             i;
+
+    (void)arg;
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        if(linkSock < 0) {
+            pollLinkState(getIfByIx(upStreamIfIdx[i]));
+        }
+        if(conf->upstreamTimeout && links[i].lastQuery && !links[i].queryLost &&
+           now - links[i].lastQuery > (time_t)conf->upstreamTimeout) {
+            my_log(LOG_WARNING, 0, "No queries on upstream %s for %d seconds.",
+                getIfByIx(upStreamIfIdx[i])->Name, conf->upstreamTimeout);
+            links[i].queryLost = 1;
+            updateUpstream(i);
+        }
+    }
+
+    timer_setTimer(LINK_POLL_INTERVAL, checkUpstreams, NULL);
+}
+
+/**
+*   Returns the socket link events come in on, or -1 if there is none.
+*/
+int getUpstreamLinkSock(void) {
+    return linkSock;
+}
+
+/**
+*   Reads the pending link events, and updates the upstream state.
+*/
+void acceptUpstreamLinkEvent(void) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+    char                buf[8192];
+    struct nlmsghdr     *nh;
+    struct ifinfomsg    *ifi;
+    struct rtattr       *rta;
+    struct IfDesc       *Dp;
+    int                 len, alen;
+
+    while((len = recv(linkSock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for(nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len)) {
+            if(nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) {
+                continue;
+            }
+            ifi  = NLMSG_DATA(nh);
+            alen = IFLA_PAYLOAD(nh);
+            for(rta = IFLA_RTA(ifi); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if(rta->rta_type != IFLA_IFNAME) {
+                    continue;
+                }
+                Dp = getIfByName(RTA_DATA(rta));
+                if(Dp != NULL) {
+                    setLinkState(Dp, nh->nlmsg_type == RTM_NEWLINK &&
+                        (ifi->ifi_flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING));
+                }
+                break;
+            }
+        }
+    }
+    if(len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        my_log(LOG_WARNING, errno, "recv link events");
+    }
+#endif
+}
+
+/**
+*   Opens the link event socket, and reads the initial link state of
+*   the upstream interfaces.
+*/
+void initUpstreamMonitor(void) {
+    struct Config   *conf = getCommonConfig();
+    int             i;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    struct sockaddr_nl sa;
+
+    linkSock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(linkSock >= 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.nl_family = AF_NETLINK;
+        sa.nl_groups = RTMGRP_LINK;
+        if(bind(linkSock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            my_log(LOG_WARNING, errno, "Unable to bind link event socket. Polling link state.");
+            close(linkSock);
+            linkSock = -1;
+        }
+    } else {
+        my_log(LOG_WARNING, errno, "Unable to open link event socket. Polling link state.");
+    }
+#endif
+
+    for(i = 0; i < MAX_UPS_VIFS && upStreamIfIdx[i] != -1; i++) {
+        pollLinkState(getIfByIx(upStreamIfIdx[i]));
+    }
+
+    if(linkSock < 0 || conf->upstreamTimeout) {
+        timer_setTimer(LINK_POLL_INTERVAL, checkUpstreams, NULL);
+    }
+}